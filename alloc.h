@@ -43,6 +43,7 @@
 #include "central_free_list.h"
 #include "large_heap.h"
 #include "mutex.h"
+#include "per_cpu_slab.h"
 
 namespace plsalloc {
 
@@ -57,8 +58,53 @@ namespace plsalloc {
 #define BULK_ALLOC 1
 
 // Set to >1 to use banked central freelists, which reduce lock contention but
-// take extra capacity
+// take some extra capacity
+#ifndef CENTRAL_FREE_LIST_BANKS
 #define CENTRAL_FREE_LIST_BANKS 1
+#endif
+
+// Set to >1 to shard the large heap, so large allocs and frees from different
+// threads mostly take different locks. Shards don't coalesce with each other,
+// so this costs some fragmentation.
+#ifndef LARGE_HEAP_SHARDS
+#define LARGE_HEAP_SHARDS 1
+#endif
+
+// Huge page policy. 0: none. 1: transparent huge pages (MADV_HUGEPAGE on the
+// 2MB-aligned regions backing tracked memory, AllocState, and the sizemap).
+// 2: like 1, but back tracked memory with explicit (hugetlbfs) huge pages if
+// the system has them reserved; freed memory is then only released to the OS
+// in whole 2MB pages. Off by default: THP backs each sparsely-touched region
+// (sizemap, AllocState, fresh spans) with whole 2MB pages, which costs several
+// MB of RSS even in small programs.
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+
+// Set to 1 to add sub-cache-line classes (8, 16, 32, and 48 bytes). Threads
+// carve these out of runs of whole lines they own, so objects allocated by
+// different threads never share a line. Requires the thread cache.
+#ifndef DENSE_CLASSES
+#define DENSE_CLASSES 0
+#endif
+
+// Native only: set to 1 to cache by CPU instead of by thread, so cache memory
+// scales with cores rather than threads. Allocs and frees first pop and push
+// per-CPU slabs with rseq (see per_cpu_slab.h), without locks. Misses and
+// overflows go to a per-CPU cache guarded by a lock, which also serves all ops
+// if rseq is unavailable.
+#ifndef PER_CPU_CACHES
+#define PER_CPU_CACHES 0
+#endif
+
+// Set to 1 to return objects freed by other threads to the cache of the thread
+// that owns their pages (the one that carved them from a fresh span), through
+// a bounded lock-free queue the owner drains on misses. Keeps producer/consumer
+// pipelines from shipping memory to consumers' caches, at the cost of an
+// atomic op per cross-thread free. Per-thread caches only.
+#ifndef REMOTE_FREES
+#define REMOTE_FREES 0
+#endif
 
 /* Layout */
 
@@ -67,15 +113,14 @@ namespace plsalloc {
 // unoptimized builds (with -O3, everything will be constant-propagated).
 // See https://stackoverflow.com/a/10376574
 
+// Tracked memory is reserved up front, and sysAlloc fails past trackedBound.
+// Untracked memory holds AllocState and the sizemap, followed by side maps at
+// fixed offsets, all well below untrackedBound (0x0c0000000000).
+static constexpr size_t kMaxTrackedSize = 512ul << 30;
 static char* const trackedBase  = (char*) PLSALLOC_TRACKED_BASEADDR;
-// FIXME: either do bounds checking to ensure trackedBump and trackedEnd don't
-// go past trackedBound, or get rid of this unused constant:
-//static char* const trackedBound = (char*) 0x0b0000000000ul;
+static char* const trackedBound = trackedBase + kMaxTrackedSize;
 
 static char* const untrackedBase  = (char*) PLSALLOC_UNTRACKED_BASEADDR;
-// FIXME: either do bounds checking to ensure sizemapBump and sizemapEnd don't
-// go past untrackedBound, or get rid of this unused constant:
-//static char* const untrackedBound = (char*) 0x0c0000000000ul;
 
 /* Global data */
 
@@ -84,31 +129,203 @@ static constexpr size_t kPageBits = 15;  // 32 KB
 static constexpr size_t kPageSize = 1ul << kPageBits;
 static inline size_t sizeToPages(size_t sz) { return (sz + kPageSize - 1) >> kPageBits; }
 
-// Use 256 freelists, with sizes 64 bytes - 16 KB in 64-byte increments.
-static constexpr size_t kMaxClasses = 256;
-static inline size_t sizeToClass(size_t sz) { return (sz + 63ul) >> 6ul; }
-static inline size_t classToSize(size_t cl) { return cl << 6ul; }
-static inline bool isLargeAlloc(size_t sz) { return sizeToClass(sz) >= kMaxClasses; }
+// Size classes use 64-byte increments up to 1 KB, then 8 classes per power of
+// two up to 256 KB. This bounds internal fragmentation to 63 bytes for small
+// sizes and to 12.5% for larger ones. Class 0 is reserved for large allocs.
+static constexpr size_t kLinearClassBits = 6;   // 64-byte increments...
+static constexpr size_t kLinearMaxBits = 10;    // ... up to 1 KB
+static constexpr size_t kGeometricBits = 3;     // 8 classes per power of two...
+static constexpr size_t kMaxSmallBits = 18;     // ... up to 256 KB
+static constexpr size_t kMaxSmallSize = 1ul << kMaxSmallBits;
+static constexpr size_t kLinearClasses = 1ul << (kLinearMaxBits - kLinearClassBits);
+static constexpr size_t kRegularClasses = 1 + kLinearClasses +
+        ((kMaxSmallBits - kLinearMaxBits) << kGeometricBits);
+
+// Dense classes follow the regular ones. Their central freelists and thread
+// cache lists hold runs (line-aligned, power-of-two chunks), which the thread
+// that allocates a run carves into objects.
+#if DENSE_CLASSES
+static constexpr size_t kDenseClasses = 4;
+static constexpr size_t kMaxDenseSize = 48;
+#else
+static constexpr size_t kDenseClasses = 0;
+#endif
+static constexpr size_t kFirstDenseClass = kRegularClasses;
+static constexpr size_t kMaxClasses = kRegularClasses + kDenseClasses;
+
+// Class ids are stored in the sizemap
+static_assert(kMaxClasses <= 256, "class ids must fit in a sizemap entry");
 
-// Pin supports 2048 threads tops
-static constexpr uint32_t kMaxThreads = 2048;
+struct SizeClassTable {
+    uint32_t sizes[kMaxClasses];       // object sizes
+    uint32_t chunkSizes[kMaxClasses];  // sizes of the chunks lists hold
+};
+
+static constexpr SizeClassTable makeSizeClassTable() {
+    SizeClassTable t = {};
+    size_t cl = 1;
+    for (; cl <= kLinearClasses; cl++) t.sizes[cl] = cl << kLinearClassBits;
+    for (size_t bits = kLinearMaxBits; bits < kMaxSmallBits; bits++) {
+        for (size_t step = 1; step <= (1ul << kGeometricBits); step++) {
+            t.sizes[cl++] = (1ul << bits) + (step << (bits - kGeometricBits));
+        }
+    }
+    for (cl = 1; cl < kRegularClasses; cl++) t.chunkSizes[cl] = t.sizes[cl];
+#if DENSE_CLASSES
+    // 48-byte objects use 256-byte runs (5 objects), the rest single lines
+    const uint32_t denseSizes[] = {8, 16, 32, 48};
+    const uint32_t runSizes[] = {64, 64, 64, 256};
+    for (size_t d = 0; d < kDenseClasses; d++) {
+        t.sizes[kFirstDenseClass + d] = denseSizes[d];
+        t.chunkSizes[kFirstDenseClass + d] = runSizes[d];
+    }
+#endif
+    return t;
+}
+
+static constexpr SizeClassTable kSizeClasses = makeSizeClassTable();
+static_assert(kSizeClasses.sizes[kRegularClasses - 1] == kMaxSmallSize, "bad size class table");
+
+static inline bool isLargeAlloc(size_t sz) { return sz > kMaxSmallSize; }
+static inline bool isDenseClass(size_t cl) { return cl >= kFirstDenseClass; }
+static inline size_t classToSize(size_t cl) { return kSizeClasses.sizes[cl]; }
+static inline size_t classToChunkSize(size_t cl) { return kSizeClasses.chunkSizes[cl]; }
+
+#if DENSE_CLASSES
+// Indexed by (sz + 7) / 8
+static constexpr uint8_t kDenseSizeToClass[] = {
+    kFirstDenseClass, kFirstDenseClass, kFirstDenseClass + 1,
+    kFirstDenseClass + 2, kFirstDenseClass + 2,
+    kFirstDenseClass + 3, kFirstDenseClass + 3,
+};
+#endif
+
+// Valid for sizes up to kMaxSmallSize. Above 1 KB, sz is in (2^bits, 2^(bits+1)],
+// and the top kGeometricBits bits below the leading one give the class.
+static inline size_t sizeToClass(size_t sz) {
+#if DENSE_CLASSES
+    if (sz <= kMaxDenseSize) return kDenseSizeToClass[(sz + 7ul) >> 3];
+#endif
+    if (sz <= (1ul << kLinearMaxBits)) return (sz + 63ul) >> kLinearClassBits;
+    size_t bits = 63 - __builtin_clzl(sz - 1);
+    return kLinearClasses + ((bits - kLinearMaxBits) << kGeometricBits)
+            + ((sz - 1) >> (bits - kGeometricBits)) - ((1ul << kGeometricBits) - 1);
+}
+
+// Size of the thread cache table. Pin supports 2048 threads tops, but native
+// runs can have many more. Caches are allocated on demand, so unused entries
+// cost only a (never touched) pointer.
+static constexpr uint32_t kMaxThreads = 1u << 16;
+#ifdef PLSALLOC_NATIVE
+static_assert(native::kMaxTids <= kMaxThreads, "native tids must index threadCaches");
+#endif
 
 // A thread cache that grows beyond this limit will donate to the central freelists
 static constexpr size_t kMaxThreadCacheSize = 4096 * 1024;
 
-// Thread caches try to fetch this much data per central list access
+// Thread cache class list limits grow up to this size (or two fetch batches,
+// whichever is larger). A list that grows beyond its limit returns one batch to
+// its central freelist.
+static constexpr size_t kMaxClassListSize = 256 * 1024;
+
+// Thread caches try to fetch up to this much data per central list access
 static constexpr size_t kFetchTargetSize = 32 * 1024;
 
+// Thread caches start fetching this many elems per class, and double it on
+// every miss up to kFetchTargetSize (slow start)
+static constexpr uint32_t kMinFetchElems = 2;
+
+// A class list that overflows more than this many times in a row shrinks its
+// limit by one batch
+static constexpr uint32_t kMaxOverflows = 3;
+
+// Thread caches shrink the limits of classes that saw no misses or overflows
+// every this many misses and overflows
+static constexpr uint32_t kScavengePeriod = 2048;
+
+#if DENSE_CLASSES
+static_assert(USE_THREADCACHE, "dense classes require the thread cache");
+#endif
+
+#if PER_CPU_CACHES
+#ifndef PLSALLOC_NATIVE
+#error "Per-CPU caches are only supported in native builds"
+#endif
+static_assert(USE_THREADCACHE, "per-CPU caches require the thread cache");
+#if DENSE_CLASSES
+#error "Dense classes need per-thread caches (each run is carved by one thread)"
+#endif
+#endif
+
+#if REMOTE_FREES
+static_assert(USE_THREADCACHE, "remote frees require the thread cache");
+#if PER_CPU_CACHES
+#error "Remote frees need per-thread caches"
+#endif
+#endif
+
 class ThreadCache {
     private:
+        // Per-class adaptive parameters. Classes that miss grow their batch
+        // and limit; classes that keep overflowing or go idle shrink them.
+        struct ClassParams {
+            uint32_t maxLength;   // list limit, in elems
+            uint32_t batchSize;   // elems per fetch or overflow donation
+            uint32_t overflows;   // overflows since last miss or limit change
+            uint32_t lastEpoch;   // epoch of the last miss or overflow
+        };
+
+#if PER_CPU_CACHES
+        mutex lock;
+#endif
         size_t cacheSize;
+        uint32_t slowPathEvents;  // misses and overflows in this epoch
+        uint32_t epoch;
         BlockedDeque<void*> classLists[kMaxClasses];
+        ClassParams params[kMaxClasses];
+
+#if DENSE_CLASSES
+        // The run each dense class is carving objects from
+        struct DenseRun {
+            char* cur;
+            char* end;
+        };
+        DenseRun denseRuns[kDenseClasses];
+#endif
+
+#if REMOTE_FREES
+        // MPSC stack of objects other threads freed to us, linked through
+        // their first word, and the bytes it holds. Off the owner's lines, as
+        // others write them.
+        void* volatile remoteFrees ATTR_LINE_ALIGNED;
+        volatile size_t remoteFreeBytes;
+        void drainRemoteFrees(bool close = false);
+#endif
+
+        void fetch(size_t cl);
+        void overflow(size_t cl);
+        void donate(size_t cl, size_t elems);
+        void markActive(size_t cl);
+        void scavenge();
 
     public:
-        ThreadCache() : cacheSize(0) {}
+        ThreadCache();
+        void flush();
         inline void* alloc(size_t cl);
         inline void dealloc(void* p, size_t cl);
         inline size_t size(size_t cl) { return classLists[cl].size(); }
+#if DENSE_CLASSES
+        inline void* denseAlloc(size_t cl);
+#endif
+#if PER_CPU_CACHES
+        inline mutex& cpuLock() { return lock; }
+#endif
+#if REMOTE_FREES
+        inline bool remoteFree(void* p, size_t cl);
+        void openRemoteFrees();
+#endif
+
+        ThreadCache* nextFree;  // links caches in the free pool
 } ATTR_LINE_ALIGNED;
 
 #if CENTRAL_FREE_LIST_BANKS <= 1
@@ -117,28 +334,225 @@ typedef CentralFreeList CentralFreeListType;
 typedef BankedCentralFreeList<CENTRAL_FREE_LIST_BANKS> CentralFreeListType;
 #endif
 
+#if LARGE_HEAP_SHARDS <= 1
+typedef LargeHeap LargeHeapType;
+#else
+static_assert(LARGE_HEAP_SHARDS <= 256, "shards are tracked with one byte per page");
+typedef ShardedLargeHeap<LARGE_HEAP_SHARDS> LargeHeapType;
+#endif
+
 // All globals go here, so we can allocate them in untracked memory
 struct AllocState {
     CentralFreeListType classLists[kMaxClasses];
-    LargeHeap largeHeap;
+    LargeHeapType largeHeap;
+
+    // Fully free small-object spans, reclaimed from the central freelists.
+    // sysAlloc reuses them for any class before growing tracked memory. All
+    // its chunks are whole pages.
+    LargeHeap spanHeap;
+
+#if PER_CPU_CACHES
+    PerCpuSlabs<kMaxClasses> slabs;
+#endif
 
 #if USE_THREADCACHE
-    ThreadCache threadCaches[kMaxThreads];
+    // Allocated on first use. Caches of exited threads are flushed and go to
+    // the free pool.
+    ThreadCache* threadCaches[kMaxThreads];
+    ThreadCache* freeThreadCaches;
+    mutex threadCacheLock;
 #endif
 
-    char* volatile trackedBump;  // volatile b/c used unlocked for valid checks
-    char* trackedEnd;
+    // Per-class maximum thread cache list limits and batch sizes, in elems
+    uint32_t classListLimits[kMaxClasses];
+    uint32_t classBatchSizes[kMaxClasses];
 
-    char* sizemapBump;
-    char* sizemapEnd;
+    // sysAlloc bumps trackedBump atomically, and commits reserved memory past
+    // trackedEnd in batches (holding commitLock). volatile b/c valid_chunk uses
+    // trackedBump unlocked.
+    char* volatile trackedBump ATTR_LINE_ALIGNED;
+    char* volatile trackedEnd;
 
-    mutex sysAllocLock ATTR_LINE_ALIGNED;
+    mutex commitLock ATTR_LINE_ALIGNED;
 } ATTR_LINE_ALIGNED;
 
 // Both AllocState and the sizemap have fixed locations in untracked mem
 static AllocState& gs = *((AllocState*)untrackedBase);
 static uint8_t* const sizemap = (uint8_t*) (untrackedBase + sizeof(AllocState));
 
+// Side maps below are reserved up front for all of tracked memory, past the
+// sizemap's maximum extent, and only touched where they are used
+
+#if DENSE_CLASSES
+// Live objects in each dense run, one byte per tracked line (indexed by the
+// run's first line). Lives in untracked memory, so frees from other threads
+// don't touch the run's lines.
+static uint8_t* const linemap = (uint8_t*) (untrackedBase + (64ul << 30));
+
+static inline uint8_t* runCount(char* run) {
+    return &linemap[(run - trackedBase) >> 6];
+}
+#endif
+
+#if REMOTE_FREES
+// Owner of each small-alloc page, as threadCaches index + 1 (0 if none)
+static uint32_t* const ownermap = (uint32_t*) (untrackedBase + (128ul << 30));
+#endif
+
+#if LARGE_HEAP_SHARDS > 1
+// LargeHeap shard of each large-alloc page
+static uint8_t* const shardmap = (uint8_t*) (untrackedBase + (192ul << 30));
+#endif
+
+// Allocated large chunk starting in each page, if any, as (size << 9) | (offset
+// in page / 64), or 0. Large chunks are larger than a page and line-aligned,
+// so at most one allocated chunk starts in each page, and the entry fits.
+static uint64_t* const largemap = (uint64_t*) (untrackedBase + (256ul << 30));
+static_assert(kMaxSmallSize >= kPageSize, "large chunks must span pages");
+
+// Span of each small-alloc page, as (first page << 32) | pages. spanstates
+// holds each span's freelist state at its first page, and spanlinks links the
+// free elems of each span, at each elem's first line (see CentralFreeList).
+static uint64_t* const spanmap = (uint64_t*) (untrackedBase + (320ul << 30));
+static SpanState* const spanstates = (SpanState*) (untrackedBase + (384ul << 30));
+static uint16_t* const spanlinks = (uint16_t*) (untrackedBase + (416ul << 30));
+static_assert((kMaxTrackedSize >> kPageBits) * sizeof(SpanState) <= (32ul << 30), "spanstates too large");
+static_assert(kMaxTrackedSize >> 5 <= (32ul << 30), "spanlinks too large");
+static_assert((kPageSize >> 6) <= 512, "page offsets must fit in 9 bits");
+
+// Whether each large-alloc page may hold nonzero data (see setPagesDirty).
+// Fresh tracked memory reads as zero, so all pages start clean.
+static uint8_t* const dirtymap = (uint8_t*) (untrackedBase + (448ul << 30));
+
+#if PER_CPU_CACHES
+static char* const slabBase = untrackedBase + (480ul << 30);
+static_assert(PerCpuSlabs<kMaxClasses>::kSize <= (32ul << 30), "slabs must fit below 512GB");
+#endif
+
+/* Fixed mappings of tracked memory, AllocState, and the sizemap. All are
+ * 2MB-aligned, so they can use huge pages.
+ */
+
+static constexpr size_t kOsPageSize = 4096;
+static constexpr size_t kHugePageBits = 21;
+static constexpr size_t kHugePageSize = 1ul << kHugePageBits;
+
+// sysAlloc commits tracked memory at least this much at a time
+static constexpr size_t kCommitBatchSize = 64ul << 20;
+
+#ifdef PLSALLOC_NATIVE
+// Large chunks at least this big are huge: they are huge-page-aligned, so
+// realloc can move their pages with mremap instead of copying them (see
+// do_remap).
+static constexpr size_t kMinHugeAllocSize = 8ul << 20;
+#endif
+
+// Returns the size of the large chunk allocated for size bytes, which must be
+// at most kMaxTrackedSize. Rounds to cache line size; large chunks must also
+// span a page (see largemap), which only matters for aligned allocs.
+static inline size_t largeChunkRound(size_t size) {
+    return std::max((size + 63ul) & (~63ul), kPageSize);
+}
+
+// Returns the alignment of large chunks of sz bytes
+static inline size_t largeChunkAlign(size_t sz) {
+#ifdef PLSALLOC_NATIVE
+    if (sz >= kMinHugeAllocSize) return kHugePageSize;
+#endif
+    return CACHE_LINE_BYTES;
+}
+
+static void* mapFixed(char* addr, size_t sz, bool tracked) {
+    assert(!((uintptr_t) addr & (kHugePageSize - 1)));
+    assert(!(sz & (kHugePageSize - 1)));
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED;
+#if HUGE_PAGES >= 2
+    if (tracked) {
+        void* mem = mmap(addr, sz, (PROT_READ|PROT_WRITE), flags|MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) return mem;
+    }
+#endif
+    // Untracked metadata is mapped whole but touched sparsely
+    if (!tracked) flags |= MAP_NORESERVE;
+    void* mem = mmap(addr, sz, (PROT_READ|PROT_WRITE), flags, -1, 0);
+#if HUGE_PAGES
+    // Only a hint; THP may be disabled
+    if (mem != MAP_FAILED) madvise(mem, sz, MADV_HUGEPAGE);
+#endif
+    return mem;
+}
+
+// Releases whole pages only, since only those track whether they're dirty, so
+// clean ones can be skipped. hugetlbfs pages can only be released whole.
+static size_t releasePages(char* start, char* end) {
+    constexpr size_t unit = (HUGE_PAGES >= 2) ? kHugePageSize : kPageSize;
+    constexpr size_t unitPages = unit >> kPageBits;
+    size_t page = (((start - trackedBase) + unit - 1) & ~(unit - 1)) >> kPageBits;
+    size_t endPage = ((end - trackedBase) & ~(unit - 1)) >> kPageBits;
+    auto unitDirty = [](size_t p) {
+        for (size_t i = 0; i < unitPages; i++) if (dirtymap[p + i]) return true;
+        return false;
+    };
+    size_t released = 0;
+    while (page < endPage) {
+        if (!unitDirty(page)) {
+            page += unitPages;
+            continue;
+        }
+        size_t runEnd = page + unitPages;
+        while (runEnd < endPage && unitDirty(runEnd)) runEnd += unitPages;
+        char* runStart = trackedBase + (page << kPageBits);
+        size_t runBytes = (runEnd - page) << kPageBits;
+        if (madvise(runStart, runBytes, MADV_DONTNEED) == 0) {
+            memset(&dirtymap[page], 0, runEnd - page);
+            released += runBytes;
+        }
+        page = runEnd;
+    }
+    return released;
+}
+
+/* Fork handlers (see native::registerForkHandlers). These take every lock,
+ * outer ones first, so the forking thread can't deadlock with threads that hold
+ * some: per-CPU caches take central freelist locks, those take the span heap's
+ * and the commit lock, and so do large heaps.
+ */
+
+#ifdef PLSALLOC_NATIVE
+static void lockForFork() {
+#if USE_THREADCACHE
+    // Also keeps the set of caches fixed
+    gs.threadCacheLock.lock();
+#if PER_CPU_CACHES
+    for (size_t idx = 0; idx < kMaxThreads; idx++) {
+        if (gs.threadCaches[idx]) gs.threadCaches[idx]->cpuLock().lock();
+    }
+#endif
+#endif
+    for (size_t cl = 1; cl < kMaxClasses; cl++) gs.classLists[cl].lockAll();
+    gs.largeHeap.lockAll();
+    gs.spanHeap.lockAll();
+    gs.commitLock.lock();
+}
+
+// Children reinitialize the locks instead of unlocking them
+static void unlockForFork(bool child) {
+    auto release = [child](mutex& m) { child ? m.reinit() : m.unlock(); };
+    release(gs.commitLock);
+    gs.spanHeap.unlockAll(child);
+    gs.largeHeap.unlockAll(child);
+    for (size_t cl = kMaxClasses - 1; cl >= 1; cl--) gs.classLists[cl].unlockAll(child);
+#if USE_THREADCACHE
+#if PER_CPU_CACHES
+    for (size_t idx = kMaxThreads; idx > 0; idx--) {
+        if (gs.threadCaches[idx - 1]) release(gs.threadCaches[idx - 1]->cpuLock());
+    }
+#endif
+    release(gs.threadCacheLock);
+#endif
+}
+#endif
+
 /* Initialization (delicate...) */
 
 // Since the loader calls initialization routines in whatever order it wants,
@@ -148,6 +562,9 @@ static uint8_t* const sizemap = (uint8_t*) (untrackedBase + sizeof(AllocState));
 // be called, but I've tried a bunch of things unsuccessfully (constructor
 // priorities, linker flags, __malloc_initialization_hook, ...).
 static bool __initialized = false;
+#if USE_THREADCACHE && defined(PLSALLOC_NATIVE) && !PER_CPU_CACHES
+static void releaseThreadCache(uint32_t tid);
+#endif
 // [victory] This constructor attribute somehow caused a crash on Ubuntu 18.04.
 //__attribute__((constructor (101)))
 void __plsalloc_init() {
@@ -155,113 +572,535 @@ void __plsalloc_init() {
     //DEBUG("init start");
     if (__initialized) return;
 
-    size_t sz = ((sizeof(AllocState) + 2 * 1024 * 1024) >> 21) << 21;
-    void* mem = mmap(untrackedBase, sz, (PROT_READ|PROT_WRITE), (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED), -1, 0);
-    if (!mem) exit(183);  // we don't even have libstdc++ here... just die with a hopefully unique exit code
+    // Map AllocState and the whole sizemap
+    size_t sz = sizeof(AllocState) + (kMaxTrackedSize >> kPageBits);
+    sz = ((sz + kHugePageSize - 1) >> kHugePageBits) << kHugePageBits;
+    void* mem = mapFixed(untrackedBase, sz, false);
+    if (mem == MAP_FAILED) exit(183);  // we don't even have libstdc++ here... just die with a hopefully unique exit code
+
+    // Reserve all of tracked memory; sysAlloc commits it as it grows
+    mem = mmap(trackedBase, kMaxTrackedSize, PROT_NONE,
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(188);
 
     // At this point, gs exists but is not initialized...
     gs.trackedBump = trackedBase;
     gs.trackedEnd = trackedBase;
 
-    gs.sizemapBump = (char*) sizemap;
-    gs.sizemapEnd = untrackedBase + sz;
+#if DENSE_CLASSES
+    mem = mmap(linemap, kMaxTrackedSize >> 6, (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(184);
+#endif
+#if REMOTE_FREES
+    mem = mmap(ownermap, (kMaxTrackedSize >> kPageBits) * sizeof(uint32_t),
+               (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(185);
+#endif
+    mem = mmap(largemap, (kMaxTrackedSize >> kPageBits) * sizeof(uint64_t),
+               (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(187);
+    mem = mmap(spanmap, (kMaxTrackedSize >> kPageBits) * sizeof(uint64_t),
+               (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(189);
+    mem = mmap(spanstates, (kMaxTrackedSize >> kPageBits) * sizeof(SpanState),
+               (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(190);
+    mem = mmap(spanlinks, kMaxTrackedSize >> 5, (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(193);
+    mem = mmap(dirtymap, kMaxTrackedSize >> kPageBits, (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(191);
+#if PER_CPU_CACHES
+    if (!gs.slabs.init(slabBase)) exit(192);
+#endif
+#if LARGE_HEAP_SHARDS > 1
+    mem = mmap(shardmap, kMaxTrackedSize >> kPageBits, (PROT_READ|PROT_WRITE),
+               (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+    if (mem == MAP_FAILED) exit(186);
+#endif
 
     // NOTE: Placement new is OK here because these classes don't call alloc
     // internally. Keep it that way!
     for (size_t cl = 1; cl < kMaxClasses; cl++) {
-        uint32_t elemsPerFetch = kFetchTargetSize / classToSize(cl);
-        elemsPerFetch = std::min((uint32_t)DQBLOCK_SIZE, std::max(elemsPerFetch, 2u));
-        new (&gs.classLists[cl]) CentralFreeListType(classToSize(cl), elemsPerFetch);
+        new (&gs.classLists[cl]) CentralFreeListType(classToChunkSize(cl), cl);
+        uint32_t elemsPerFetch = kFetchTargetSize / classToChunkSize(cl);
+        elemsPerFetch = std::min((uint32_t)DQBLOCK_SIZE, std::max(elemsPerFetch, kMinFetchElems));
+        uint32_t listLimit = kMaxClassListSize / classToChunkSize(cl);
+        gs.classListLimits[cl] = std::max(listLimit, 2 * elemsPerFetch);
+        gs.classBatchSizes[cl] = elemsPerFetch;
+#if PER_CPU_CACHES
+        // Slabs hold up to a fetch's worth of bytes per class (classes larger
+        // than that skip them)
+        gs.slabs.setCapacity(cl, kFetchTargetSize / classToChunkSize(cl));
+#endif
     }
-    new (&gs.largeHeap) LargeHeap();
+    new (&gs.largeHeap) LargeHeapType();
+    new (&gs.spanHeap) LargeHeap();
 
 #if USE_THREADCACHE
-    for (uint32_t tid = 0; tid < kMaxThreads; tid++) {
-        new (&gs.threadCaches[tid]) ThreadCache();
-    }
+    // threadCaches and freeThreadCaches start zeroed (mmap'd)
+    new (&gs.threadCacheLock) mutex();
+#if defined(PLSALLOC_NATIVE) && !PER_CPU_CACHES
+    native::tidExitHook = releaseThreadCache;
+#endif
 #endif
 
-    new (&gs.sysAllocLock) mutex();
+    new (&gs.commitLock) mutex();
 
     __initialized = true;
+#ifdef PLSALLOC_NATIVE
+    native::registerForkHandlers(lockForFork, unlockForFork);
+#endif
     //DEBUG("init done %ld", sz);
 }
 
 /* System alloc and sizemap management */
 
-static std::tuple<char*, char*> sysAlloc(size_t chunkSize) {
-    size_t minPages = sizeToPages(chunkSize);
-    // To reduce freelist fragmentation and reduce the number of calls to the
-    // allocator, give out 32 pages at once (32*32KB*256 = 256MB overage in the
-    // worst case, i.e. all freelists used and they use only one element)
-    size_t pages = std::max(32ul, minPages);
+// Maps the pages of a small-alloc span to its class and span, with no free
+// elems. The side maps are mapped whole, and each span owns its pages'
+// entries, so no lock is needed.
+static void stampSpan(char* span, size_t pages, uint8_t cl) {
+    size_t base = (span - trackedBase) >> kPageBits;
+    for (size_t page = 0; page < pages; page++) {
+        sizemap[base + page] = cl;
+        spanmap[base + page] = (base << 32) | pages;
+    }
+    SpanState& s = spanstates[base];
+    s.elems = (pages << kPageBits) / classToChunkSize(cl);
+    s.freeElems = 0;
+    s.freeHead = 0;
+    s.bucket = kNoBucket;
+}
+
+static std::tuple<char*, char*> sysAlloc(size_t size, uint8_t cl) {
+    // Central freelists size their own spans (see CentralFreeList::growSpan).
+    // The large heap splits and merges its spans, so give it 32 pages at once
+    // to reduce the number of calls to the allocator.
+    size_t pages = cl ? sizeToPages(size) : std::max(32ul, sizeToPages(size));
     size_t allocSize = pages << kPageBits;
-    assert(allocSize >= chunkSize);
-
-    auto allocContiguous = [](size_t sz, char*& bump, char*& end) {
-        char* alloc = bump;
-        bump += sz;
-        if (bump > end) {
-            // mmap at least 2MB (so we can use superpages)
-            size_t mmapSz = (((bump - end) >> 21ul) + 1ul) << 21ul;
-            void* mem = mmap(end, mmapSz, (PROT_READ|PROT_WRITE), (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED), -1, 0);
-            (void) mem;
-            assert(mem);
-            end += mmapSz;
-            assert(end >= bump);
+    assert(allocSize >= size);
+
+    // Small spans reuse reclaimed spans if possible
+    char* alloc = cl ? (char*) gs.spanHeap.alloc(allocSize, kPageSize, false) : nullptr;
+    if (alloc) {
+        stampSpan(alloc, pages, cl);
+        return std::make_tuple(alloc, alloc + allocSize);
+    }
+
+    // Grab tracked memory. Check the bound before bumping, so a failed
+    // sysAlloc doesn't make later, smaller ones fail too.
+    alloc = gs.trackedBump;
+    while (true) {
+        if (unlikely((size_t) (trackedBound - alloc) < allocSize)) {
+            return std::make_tuple(nullptr, nullptr);
         }
-        return alloc;
-    };
+        char* prev = __sync_val_compare_and_swap(&gs.trackedBump, alloc, alloc + allocSize);
+        if (likely(prev == alloc)) break;
+        alloc = prev;
+    }
 
-    scoped_mutex sm(gs.sysAllocLock);
+    // Commit it if needed. Commit in large batches, so most sysAllocs don't
+    // take the lock, and threads that commit don't hold up the others.
+    if (unlikely(alloc + allocSize > gs.trackedEnd)) {
+        scoped_mutex sm(gs.commitLock);
+        char* end = gs.trackedEnd;
+        if (alloc + allocSize > end) {
+            size_t minCommitSz = alloc + allocSize - end;
+            minCommitSz = ((minCommitSz + kHugePageSize - 1) >> kHugePageBits) << kHugePageBits;
+            size_t commitSz = std::max(kCommitBatchSize, minCommitSz);
+            commitSz = std::min(commitSz, (size_t) (trackedBound - end));
+            void* mem = mapFixed(end, commitSz, true);
+            if (mem == MAP_FAILED && commitSz > minCommitSz) {
+                // Near the system's limits, a whole batch may not fit
+                commitSz = minCommitSz;
+                mem = mapFixed(end, commitSz, true);
+            }
+            if (unlikely(mem == MAP_FAILED)) {
+                // Give the range back if no one bumped past it since, so a
+                // later commit doesn't skip over it. Otherwise it's lost, but
+                // later sysAllocs still commit from trackedEnd.
+                __sync_bool_compare_and_swap(&gs.trackedBump, alloc + allocSize, alloc);
+                return std::make_tuple(nullptr, nullptr);
+            }
+            __sync_synchronize();
+            gs.trackedEnd = end + commitSz;
+        }
+    }
 
-    // Grab tracked memory
-    char* trackedBump = gs.trackedBump;
-    char* alloc = allocContiguous(allocSize, trackedBump, gs.trackedEnd);
+    // No need to initialize anything with large allocs, because large-alloc
+    // pages use class 0 and mmap returns zero'd mem
+    if (cl) stampSpan(alloc, pages, cl);
+    return std::make_tuple(alloc, alloc + allocSize);
+}
 
-    // Update trackedBump (which is volatile b/c valid_chunk uses it unlocked)
-    gs.trackedBump = trackedBump;
-    __sync_synchronize();
+/* Span reclamation. Central freelists index their spans by free elems, and
+ * note how many bytes of spans are fully free. Once these are a good part of a
+ * class's freelists, the class reclaims them: it removes them from the indexes
+ * of all its banks and hands them to the span heap, which merges them and
+ * returns large ones to the OS.
+ */
 
-    // Grab sizemap memory
-    allocContiguous(pages, gs.sizemapBump, gs.sizemapEnd);
+static inline size_t spanFirstPage(void* p) {
+    return spanmap[((char*)p - trackedBase) >> kPageBits] >> 32;
+}
 
-    // If it's a small alloc, set sizemap entries to the right class.
-    // (no need to initialize anything with large allocs, because large-alloc
-    // pages use class 0 and mmap returns zero'd mem)
-    if (!isLargeAlloc(chunkSize)) {
-        size_t cl = sizeToClass(chunkSize);
-        size_t base = (alloc - trackedBase) >> kPageBits;
-        for (size_t page = 0; page < pages; page++) {
-            sizemap[base + page] = cl;
-        }
+static inline size_t spanPages(size_t firstPage) {
+    return (uint32_t) spanmap[firstPage];
+}
+
+static inline size_t spanBytes(size_t firstPage) {
+    return spanPages(firstPage) << kPageBits;
+}
+
+static inline char* spanStart(size_t firstPage) {
+    return trackedBase + (firstPage << kPageBits);
+}
+
+static inline SpanState& spanState(size_t firstPage) { return spanstates[firstPage]; }
+
+static inline uint16_t& spanLink(void* p) {
+    return spanlinks[((char*)p - trackedBase) >> 6];
+}
+
+static void donateFreeSpans(BlockedDeque<void*>& spans) {
+    while (!spans.empty()) {
+        char* span = (char*) spans.dequeue_back();
+        size_t firstPage = (span - trackedBase) >> kPageBits;
+        size_t bytes = spanBytes(firstPage);
+        DEBUG("Reclaiming span %ld pages %ld", firstPage, bytes >> kPageBits);
+        gs.spanHeap.donate(span, bytes);
     }
-    return std::make_tuple(alloc, alloc + allocSize);
 }
 
+#if PER_CPU_CACHES
+// CPU ids past kMaxThreads share caches, which is safe since caches are locked
+static inline uint64_t cacheIdx() { return native::curCpu() % kMaxThreads; }
+#else
+static inline uint64_t cacheIdx() { return sim_get_tid(); }
+#endif
+
+#if USE_THREADCACHE
+// Slow path of getThreadCache(): reuses a pooled cache or allocates a new one.
+// Returns nullptr if out of memory.
+static ThreadCache* newThreadCache(uint64_t idx) {
+    scoped_mutex sm(gs.threadCacheLock);
+    // Per-CPU caches are shared, so another thread may have beaten us
+    ThreadCache* tc = gs.threadCaches[idx];
+    if (tc) return tc;
+    tc = gs.freeThreadCaches;
+    if (tc) {
+        gs.freeThreadCaches = tc->nextFree;
+#if REMOTE_FREES
+        tc->openRemoteFrees();
+#endif
+    } else {
+        // Untracked mem is only 16B-aligned; these are never freed, so just
+        // over-allocate and align
+        size_t sz = sizeof(ThreadCache) + CACHE_LINE_BYTES;
+        uintptr_t mem = (uintptr_t) sim_zero_cycle_untracked_malloc(sz);
+        if (unlikely(!mem)) return nullptr;
+        mem = (mem + CACHE_LINE_BYTES - 1) & ~(CACHE_LINE_BYTES - 1);
+        tc = new ((void*) mem) ThreadCache();
+    }
+    __atomic_store_n(&gs.threadCaches[idx], tc, __ATOMIC_RELEASE);
+    return tc;
+}
+
+// Returns nullptr if the cache doesn't exist and there's no memory for it.
+// Callers then alloc nothing, and free to the central freelists directly.
+static inline ThreadCache* getThreadCache(uint64_t idx) {
+    ThreadCache* tc = __atomic_load_n(&gs.threadCaches[idx], __ATOMIC_ACQUIRE);
+    if (unlikely(!tc)) tc = newThreadCache(idx);
+    return tc;
+}
+#endif
+
+#if USE_THREADCACHE && defined(PLSALLOC_NATIVE) && !PER_CPU_CACHES
+// Called as a thread exits, before its id is recycled. Flushes the cache, so
+// short-lived threads don't strand memory, and pools it. The cache is
+// unpublished first, so no remote frees arrive after the flush (frees that
+// already loaded it find its remote frees closed).
+static void releaseThreadCache(uint32_t tid) {
+    ThreadCache* tc;
+    {
+        scoped_mutex sm(gs.threadCacheLock);
+        tc = gs.threadCaches[tid];
+        if (!tc) return;
+        __atomic_store_n(&gs.threadCaches[tid], nullptr, __ATOMIC_RELEASE);
+    }
+    tc->flush();
+    scoped_mutex sm(gs.threadCacheLock);
+    tc->nextFree = gs.freeThreadCaches;
+    gs.freeThreadCaches = tc;
+}
+#endif
+
 static inline uint8_t chunkToClass(void* p) {
     return sizemap[((char*)p - trackedBase) >> kPageBits];
 }
 
+static void setLargeHeapShard(char* start, char* end, uint8_t shard) {
+#if LARGE_HEAP_SHARDS > 1
+    size_t lastPage = (end - 1 - trackedBase) >> kPageBits;
+    for (size_t page = (start - trackedBase) >> kPageBits; page <= lastPage; page++) {
+        shardmap[page] = shard;
+    }
+#else
+    (void) start;
+    (void) end;
+    (void) shard;
+#endif
+}
+
+static uint8_t largeHeapShard(void* p) {
+#if LARGE_HEAP_SHARDS > 1
+    return shardmap[((char*)p - trackedBase) >> kPageBits];
+#else
+    (void) p;
+    return 0;
+#endif
+}
+
+static void setLargeChunkSize(char* chunk, size_t size) {
+    size_t offset = chunk - trackedBase;
+    uint64_t* entry = &largemap[offset >> kPageBits];
+    uint64_t lineInPage = (offset & (kPageSize - 1)) >> 6;
+    if (size) {
+        assert(!(offset & 63ul));
+        __atomic_store_n(entry, (size << 9) | lineInPage, __ATOMIC_RELAXED);
+    } else if ((__atomic_load_n(entry, __ATOMIC_RELAXED) & 511ul) == lineInPage) {
+        __atomic_store_n(entry, 0ul, __ATOMIC_RELAXED);
+    }
+}
+
+// Pages are dirtied when any of their bytes may have been used, but cleaned
+// only if all of them were released. Only whole pages of a chunk tell whether
+// its bytes there are zero; others may be shared with allocated chunks.
+static void setPagesDirty(char* start, char* end, bool dirty) {
+    size_t offset = start - trackedBase;
+    size_t endOffset = end - trackedBase;
+    size_t firstPage, endPage;
+    if (dirty) {
+        firstPage = offset >> kPageBits;
+        endPage = (endOffset + kPageSize - 1) >> kPageBits;
+    } else {
+        firstPage = (offset + kPageSize - 1) >> kPageBits;
+        endPage = endOffset >> kPageBits;
+    }
+    if (firstPage < endPage) memset(&dirtymap[firstPage], dirty, endPage - firstPage);
+}
+
+// Returns 0 if no allocated large chunk starts at p (e.g., a stale pointer)
+static inline size_t largeChunkSize(void* p) {
+    size_t offset = (char*)p - trackedBase;
+    uint64_t entry = __atomic_load_n(&largemap[offset >> kPageBits], __ATOMIC_RELAXED);
+    uint64_t lineInPage = (offset & (kPageSize - 1)) >> 6;
+    bool match = !(offset & 63ul) && (entry & 511ul) == lineInPage;
+    return match ? (entry >> 9) : 0;
+}
+
+static void setPageOwner(char* start, char* end) {
+#if REMOTE_FREES
+    uint32_t owner = cacheIdx() + 1;
+    size_t lastPage = (end - 1 - trackedBase) >> kPageBits;
+    for (size_t page = (start - trackedBase) >> kPageBits; page <= lastPage; page++) {
+        if (ownermap[page] != owner) ownermap[page] = owner;
+    }
+#else
+    (void) start;
+    (void) end;
+#endif
+}
+
 /* Thread cache methods (performance-sensitive) */
 
+// NOTE: Caches live in untracked memory, which need not be zeroed
+ThreadCache::ThreadCache() : cacheSize(0), slowPathEvents(0), epoch(0) {
+#if REMOTE_FREES
+    openRemoteFrees();
+#endif
+#if DENSE_CLASSES
+    for (size_t d = 0; d < kDenseClasses; d++) {
+        denseRuns[d].cur = denseRuns[d].end = nullptr;
+    }
+#endif
+    for (size_t cl = 1; cl < kMaxClasses; cl++) {
+        classLists[cl].init();
+        ClassParams& cp = params[cl];
+        cp.batchSize = std::min(kMinFetchElems, gs.classBatchSizes[cl]);
+        cp.maxLength = cp.batchSize;
+        cp.overflows = 0;
+        cp.lastEpoch = 0;
+    }
+}
+
+#if REMOTE_FREES
+// flush() closes the stack, so frees that race with the owner's exit don't
+// strand objects in a pooled cache
+static void* const kRemoteFreesClosed = (void*) 1ul;
+
+// Returns false if the stack is closed or full; the freeing thread then frees
+// p locally. The bound keeps an idle owner from accumulating garbage.
+bool ThreadCache::remoteFree(void* p, size_t cl) {
+    if (remoteFreeBytes >= kMaxThreadCacheSize) return false;
+    void* head;
+    do {
+        head = remoteFrees;
+        if (head == kRemoteFreesClosed) return false;
+        *(void**) p = head;
+    } while (!__sync_bool_compare_and_swap(&remoteFrees, head, p));
+    __sync_fetch_and_add(&remoteFreeBytes, classToChunkSize(cl));
+    return true;
+}
+
+void ThreadCache::openRemoteFrees() {
+    remoteFrees = nullptr;
+    remoteFreeBytes = 0;
+}
+
+// Takes the whole stack at once (so there's no ABA problem) and frees its
+// objects locally. With close, leaves the stack closed.
+void ThreadCache::drainRemoteFrees(bool close) {
+    void* p = __sync_lock_test_and_set(&remoteFrees, close ? kRemoteFreesClosed : nullptr);
+    if (p == kRemoteFreesClosed) p = nullptr;
+    size_t bytes = 0;
+    while (p) {
+        void* next = *(void**) p;
+        uint8_t cl = chunkToClass(p);
+        bytes += classToChunkSize(cl);
+        dealloc(p, cl);
+        p = next;
+    }
+    __sync_fetch_and_sub(&remoteFreeBytes, bytes);
+}
+#endif
+
+void ThreadCache::fetch(size_t cl) {
+    ClassParams& cp = params[cl];
+#if REMOTE_FREES
+    if (remoteFrees) {
+        drainRemoteFrees();
+        if (!classLists[cl].empty()) return;
+    }
+#endif
+    DEBUG("bulkAlloc start class %ld batch %d", classToChunkSize(cl), cp.batchSize);
+    if (unlikely(!gs.classLists[cl].bulkAlloc(classLists[cl], cp.batchSize))) return;  // OOM
+    cacheSize += classToChunkSize(cl) * classLists[cl].size();
+    DEBUG("bulkAlloc done elems %ld", classLists[cl].size());
+
+    // Slow start: every miss doubles the batch and makes room for one more
+    // batch in the list. Keeps maxLength >= batchSize, which donate() needs.
+    cp.batchSize = std::min(2 * cp.batchSize, gs.classBatchSizes[cl]);
+    cp.maxLength = std::min(cp.maxLength + cp.batchSize, gs.classListLimits[cl]);
+    cp.overflows = 0;
+    markActive(cl);
+}
+
+void ThreadCache::overflow(size_t cl) {
+    ClassParams& cp = params[cl];
+    donate(cl, cp.batchSize);
+
+    // A class that keeps overflowing frees more than it allocates, and a long
+    // list doesn't help it
+    if (++cp.overflows > kMaxOverflows) {
+        cp.maxLength = std::max(cp.maxLength - cp.batchSize, cp.batchSize);
+        cp.overflows = 0;
+    }
+    markActive(cl);
+}
+
+// Returns elems to the central freelist. bulkDealloc requires that the list
+// keeps at least one elem.
+void ThreadCache::donate(size_t cl, size_t elems) {
+    size_t startElems = classLists[cl].size();
+    assert(startElems > elems);
+    gs.classLists[cl].bulkDealloc(classLists[cl], elems);
+    cacheSize -= (startElems - classLists[cl].size()) * classToChunkSize(cl);
+}
+
+void ThreadCache::markActive(size_t cl) {
+    params[cl].lastEpoch = epoch;
+    if (unlikely(++slowPathEvents >= kScavengePeriod)) scavenge();
+}
+
+// Halves the batch and limit of every class that saw no misses or overflows
+// during this epoch, and returns elems beyond the new limit
+void ThreadCache::scavenge() {
+    DEBUG("TC: Scavenging, start size %ld", cacheSize);
+    for (size_t cl = 1; cl < kMaxClasses; cl++) {
+        ClassParams& cp = params[cl];
+        if (cp.lastEpoch == epoch) continue;
+        uint32_t minBatchSize = std::min(kMinFetchElems, gs.classBatchSizes[cl]);
+        cp.batchSize = std::max(cp.batchSize / 2, minBatchSize);
+        cp.maxLength = std::max(cp.maxLength / 2, cp.batchSize);
+        size_t elems = classLists[cl].size();
+        if (elems > cp.maxLength) donate(cl, elems - cp.maxLength);
+    }
+    epoch++;
+    slowPathEvents = 0;
+#if REMOTE_FREES
+    // Don't leave remote frees waiting for our next miss
+    if (remoteFrees) drainRemoteFrees();
+#endif
+    DEBUG("TC: Scavenging done, end size %ld", cacheSize);
+}
+
+// Returns all cached elems (and any partially carved dense runs) to the
+// central freelists. Used when the cache's thread exits, after unpublishing
+// the cache; closes its remote frees until openRemoteFrees().
+void ThreadCache::flush() {
+    DEBUG("TC: Flushing, start size %ld", cacheSize);
+#if REMOTE_FREES
+    drainRemoteFrees(true);
+#endif
+#if DENSE_CLASSES
+    for (size_t d = 0; d < kDenseClasses; d++) {
+        DenseRun& run = denseRuns[d];
+        if (run.cur == run.end) continue;
+        // Drop the objects we won't carve; the run is freed once the carved
+        // ones are (or now, if they already are)
+        size_t cl = kFirstDenseClass + d;
+        char* start = (char*) ((uintptr_t) run.cur & ~(classToChunkSize(cl) - 1));
+        uint8_t uncarved = (run.end - run.cur) / classToSize(cl);
+        if (__sync_sub_and_fetch(runCount(start), uncarved) == 0) {
+            dealloc(start, cl);
+        }
+        run.cur = run.end = nullptr;
+    }
+#endif
+    for (size_t cl = 1; cl < kMaxClasses; cl++) {
+        // donate() must leave one elem behind, so free the last one directly
+        while (classLists[cl].size() > 1) donate(cl, classLists[cl].size() - 1);
+        if (!classLists[cl].empty()) {
+            gs.classLists[cl].dealloc(classLists[cl].dequeue_back());
+            cacheSize -= classToChunkSize(cl);
+        }
+    }
+    assert(cacheSize == 0);
+    DEBUG("TC: Flushing done");
+}
+
 void* ThreadCache::alloc(size_t cl) {
 #if BULK_ALLOC
     if (unlikely(classLists[cl].empty())) {
-        DEBUG("bulkAlloc start class %ld", classToSize(cl));
-        gs.classLists[cl].bulkAlloc(classLists[cl]);
-        cacheSize += classToSize(cl) * classLists[cl].size();
-        DEBUG("bulkAlloc done elems %ld", classLists[cl].size());
+        fetch(cl);
+        if (unlikely(classLists[cl].empty())) return nullptr;  // out of memory
     }
     void* res = classLists[cl].dequeue_back();
-    cacheSize -= classToSize(cl);
+    cacheSize -= classToChunkSize(cl);
 #else
     void* res;
     if (unlikely(classLists[cl].empty())) {
         res = gs.classLists[cl].alloc();
     } else {
         res = classLists[cl].dequeue_back();
-        cacheSize -= classToSize(cl);
+        cacheSize -= classToChunkSize(cl);
     }
 #endif
     return res;
@@ -269,9 +1108,17 @@ void* ThreadCache::alloc(size_t cl) {
 
 void ThreadCache::dealloc(void* p, size_t cl) {
     classLists[cl].push_back(p);
-    cacheSize += classToSize(cl);
+    cacheSize += classToChunkSize(cl);
 
-    // NOTE: This code takes about 10K cycles to traverse all 256 classLists.
+    // Common overflow case: a single class list got too long (e.g., a thread
+    // that frees objects that others allocate). Return one batch of that class
+    // only, which is cheap and keeps the rest of the cache warm.
+    if (unlikely(classLists[cl].size() > params[cl].maxLength)) overflow(cl);
+
+    // Global pressure: class lists are within their limits, but together they
+    // exceed the thread cache size.
+    //
+    // NOTE: This code took about 10K cycles to traverse 256 classLists.
     // It likely blows up the L1. However, this is rare enough that it doesn't
     // matter. I tried remembering the used classes in a bitset to accelerate
     // the process. This brings down the cost of a collection with a single
@@ -287,13 +1134,98 @@ void ThreadCache::dealloc(void* p, size_t cl) {
             assert(elems);
             size_t elemsToDonate = (elems + 1) / 2;
             gs.classLists[cl].bulkDealloc(classLists[cl], elemsToDonate);
-            cacheSize -= (elems - classLists[cl].size()) * classToSize(cl);
+            cacheSize -= (elems - classLists[cl].size()) * classToChunkSize(cl);
         }
         DEBUG("TC: Donation done, end size %ld", cacheSize);
     }
 }
 
-/* Internal alloc interface. All external functions use only these four.
+#if DENSE_CLASSES
+void* ThreadCache::denseAlloc(size_t cl) {
+    DenseRun& run = denseRuns[cl - kFirstDenseClass];
+    if (unlikely(run.cur == run.end)) {
+        // Grab a new run. All its objects count as live until freed.
+        char* start = (char*) alloc(cl);
+        if (unlikely(!start)) return nullptr;
+        size_t objs = classToChunkSize(cl) / classToSize(cl);
+        *runCount(start) = objs;
+        run.cur = start;
+        run.end = start + objs * classToSize(cl);
+    }
+    void* res = run.cur;
+    run.cur += classToSize(cl);
+    return res;
+}
+#endif
+
+#if PER_CPU_CACHES
+// Slab misses alloc from the current CPU's cache, and refill half the slab from
+// it, so the next allocs hit
+static void* slabMiss(size_t cl) {
+    uint64_t idx = cacheIdx();
+    ThreadCache* tcp = getThreadCache(idx);
+    if (unlikely(!tcp)) return nullptr;
+    ThreadCache& tc = *tcp;
+    scoped_mutex sm(tc.cpuLock());
+    DEBUG("slabMiss cl %ld cache %ld sz %ld", cl, idx, tc.size(cl));
+    void* res = tc.alloc(cl);
+    for (uint32_t i = gs.slabs.capacity(cl) / 2; res && i && tc.size(cl); i--) {
+        void* p = tc.alloc(cl);
+        if (!gs.slabs.push(cl, p)) {
+            // Others refilled it, or we migrated to a fuller CPU
+            tc.dealloc(p, cl);
+            break;
+        }
+    }
+    return res;
+}
+
+// Full slabs move half their objects to the current CPU's cache
+static void slabOverflow(void* p, size_t cl) {
+    uint64_t idx = cacheIdx();
+    ThreadCache* tcp = getThreadCache(idx);
+    if (unlikely(!tcp)) {
+        gs.classLists[cl].dealloc(p);
+        return;
+    }
+    ThreadCache& tc = *tcp;
+    scoped_mutex sm(tc.cpuLock());
+    DEBUG("slabOverflow cl %ld cache %ld sz %ld", cl, idx, tc.size(cl));
+    for (uint32_t i = gs.slabs.capacity(cl) / 2; i; i--) {
+        void* q = gs.slabs.pop(cl);
+        if (!q) break;
+        tc.dealloc(q, cl);
+    }
+    tc.dealloc(p, cl);
+}
+#endif
+
+static inline void* alloc_class(size_t cl) {
+#if USE_THREADCACHE
+#if PER_CPU_CACHES
+    void* res = gs.slabs.pop(cl);
+    if (likely(res != nullptr)) return res;
+    return slabMiss(cl);
+#else
+    uint64_t idx = cacheIdx();
+    ThreadCache* tcp = getThreadCache(idx);
+    if (unlikely(!tcp)) return nullptr;
+    ThreadCache& tc = *tcp;
+    DEBUG("alloc_class cl %ld cache %ld sz %ld", cl, idx, tc.size(cl));
+#if DENSE_CLASSES
+    if (isDenseClass(cl)) return tc.denseAlloc(cl);
+#endif
+    return tc.alloc(cl);
+#endif
+#else
+    return gs.classLists[cl].alloc();
+#endif
+}
+
+/* Internal alloc interface. All external functions use only these seven (and
+ * malloc_trim uses do_trim, realloc do_remap (native) and sized_class_matches,
+ * and calloc known_zero_pages).
+ * do_alloc and do_aligned_alloc return nullptr if out of memory.
  * do_dealloc and chunk_size assume the pointer is valid. External functions
  * must first check this with valid_chunk.
  */
@@ -304,33 +1236,132 @@ static inline void* do_alloc(size_t chunkSize) {
     if (unlikely(!__initialized)) __plsalloc_init();
     void* res;
     if (likely(!isLargeAlloc(chunkSize))) {
-        size_t cl = sizeToClass(chunkSize);
-#if USE_THREADCACHE
-        uint64_t tid = sim_get_tid();
-        DEBUG("do_alloc cl %ld tid %ld sz %ld",
-              cl, tid, gs.threadCaches[tid].size(cl));
-        res = gs.threadCaches[tid].alloc(cl);
-#else
-        res = gs.classLists[cl].alloc();
-#endif
+        res = alloc_class(sizeToClass(chunkSize));
+    } else if (unlikely(chunkSize > kMaxTrackedSize)) {
+        res = nullptr;  // can't fit, and rounding it up could overflow
     } else {
-        size_t sz = (chunkSize + 63ul) & (~63ul);  // round to cache line size
-        res = gs.largeHeap.alloc(sz);
+        size_t sz = largeChunkRound(chunkSize);
+        res = gs.largeHeap.alloc(sz, largeChunkAlign(sz));
     }
     DEBUG("do_alloc(%ld) -> %p", chunkSize, res);
     return res;
 }
 
-static inline void do_dealloc(void* p) {
-    DEBUG("do_dealloc(%p)", p);
-    if (!p) return;
-    uint8_t cl = chunkToClass(p);
+// Returns the class do_aligned_alloc uses for chunkSize bytes aligned to align
+// (a power of 2), or 0 if it uses a large chunk. Objects of a class are aligned
+// to the lowest set bit of their size, up to a page (spans are page-aligned and
+// objects are packed), so small requests use the first class whose size is a
+// multiple of align.
+static inline uint8_t alignedSizeToClass(size_t chunkSize, size_t align) {
+    size_t sz = std::max(chunkSize, align);
+    if (align > kPageSize || isLargeAlloc(sz)) return 0;
+    size_t cl = sizeToClass(sz);
+#if DENSE_CLASSES
+    // Dense classes are at the end, so don't walk past them
+    if (isDenseClass(cl) && (classToSize(cl) & (align - 1))) {
+        cl = sizeToClass(kMaxDenseSize + 1);
+    }
+#endif
+    while (classToSize(cl) & (align - 1)) cl++;
+    assert(cl < kRegularClasses || isDenseClass(cl));
+    return cl;
+}
+
+// align must be a power of 2. Requests that no class fits are carved aligned
+// from the large heap.
+static inline void* do_aligned_alloc(size_t chunkSize, size_t align) {
+    DEBUG("do_aligned_alloc(%ld, %ld)", chunkSize, align);
+    if (unlikely(!__initialized)) __plsalloc_init();
+    assert(align && !(align & (align - 1)));
+    void* res;
+    uint8_t cl = alignedSizeToClass(chunkSize, align);
+    if (cl) {
+        res = alloc_class(cl);
+    } else if (unlikely(chunkSize > kMaxTrackedSize || align > kMaxTrackedSize)) {
+        res = nullptr;  // can't fit, and rounding it up could overflow
+    } else {
+        size_t sz = largeChunkRound(chunkSize);
+        res = gs.largeHeap.alloc(sz, std::max(align, largeChunkAlign(sz)));
+    }
+    DEBUG("do_aligned_alloc(%ld, %ld) -> %p", chunkSize, align, res);
+    return res;
+}
+
+// Resizes a large chunk in place to hold size bytes, if it stays large.
+// Shrinking frees memory right away, so it's optional. Returns false if the
+// chunk can't be resized in place.
+static inline bool do_resize(void* p, size_t size, bool canShrink) {
+    DEBUG("do_resize(%p, %ld)", p, size);
+    if (chunkToClass(p) || !isLargeAlloc(size) || size > kMaxTrackedSize) return false;
+    size_t sz = largeChunkRound(size);
+    if (sz < largeChunkSize(p) && !canShrink) return false;
+    return gs.largeHeap.resize(p, sz);
+}
+
+#ifdef PLSALLOC_NATIVE
+// Moves huge chunk p to a new huge chunk of size bytes, with its contents.
+// Whole huge pages are moved with mremap, which only rewrites page tables; only
+// the tail is copied. MREMAP_DONTUNMAP leaves the old range mapped (reading as
+// zero), so it's never a hole another mmap could take, and the chunk can be
+// freed as usual. If the pages can't be moved, they're copied. Returns nullptr
+// if p or size isn't huge, or if out of memory. (The simulator tracks data by
+// address, so this is native-only.)
+static inline void* do_remap(void* p, size_t size) {
+    DEBUG("do_remap(%p, %ld)", p, size);
+    if (chunkToClass(p) || size < kMinHugeAllocSize) return nullptr;
+    size_t oldSize = largeChunkSize(p);
+    if (oldSize < kMinHugeAllocSize || ((uintptr_t) p & (kHugePageSize - 1))) return nullptr;
+
+    char* src = (char*) p;
+    char* dst = (char*) do_alloc(size);
+    if (unlikely(!dst)) return nullptr;
+    assert(!((uintptr_t) dst & (kHugePageSize - 1)));
+    size_t copySize = std::min(oldSize, size);
+    size_t moveSize = 0;
+#ifdef MREMAP_DONTUNMAP
+    moveSize = copySize & ~(kHugePageSize - 1);
+    void* mem = mremap(src, moveSize, moveSize,
+                       MREMAP_MAYMOVE|MREMAP_FIXED|MREMAP_DONTUNMAP, dst);
+    // e.g., an old kernel, hugetlbfs pages, or src spans several mappings
+    if (mem == MAP_FAILED) moveSize = 0;
+#endif
+    memcpy(dst + moveSize, src + moveSize, copySize - moveSize);
+    return dst;
+}
+#endif
+
+// Frees p, of class cl (0 for large chunks)
+static inline void dealloc_class(void* p, uint8_t cl) {
     if (cl) {
 #if USE_THREADCACHE
-        uint64_t tid = sim_get_tid();
-        DEBUG("do_dealloc cl %d tid %ld sz %ld",
-              cl, tid, gs.threadCaches[tid].size(cl));
-        gs.threadCaches[tid].dealloc(p, cl);
+#if DENSE_CLASSES
+        if (isDenseClass(cl)) {
+            // Runs are freed whole, once all their objects are
+            char* run = (char*) ((uintptr_t) p & ~(classToChunkSize(cl) - 1));
+            if (__sync_sub_and_fetch(runCount(run), 1) != 0) return;
+            p = run;
+        }
+#endif
+#if PER_CPU_CACHES
+        if (unlikely(!gs.slabs.push(cl, p))) slabOverflow(p, cl);
+#else
+        uint64_t idx = cacheIdx();
+#if REMOTE_FREES
+        // Objects from other threads' pages go back to their owners (if alive)
+        uint32_t owner = ownermap[((char*)p - trackedBase) >> kPageBits];
+        if (owner && owner - 1 != idx) {
+            ThreadCache* otc = __atomic_load_n(&gs.threadCaches[owner - 1], __ATOMIC_ACQUIRE);
+            if (otc && otc->remoteFree(p, cl)) return;
+        }
+#endif
+        ThreadCache* tc = getThreadCache(idx);
+        if (unlikely(!tc)) {
+            gs.classLists[cl].dealloc(p);
+            return;
+        }
+        DEBUG("do_dealloc cl %d cache %ld sz %ld", cl, idx, tc->size(cl));
+        tc->dealloc(p, cl);
+#endif
 #else
         gs.classLists[cl].dealloc(p);
 #endif
@@ -340,9 +1371,68 @@ static inline void do_dealloc(void* p) {
     }
 }
 
+static inline void do_dealloc(void* p) {
+    DEBUG("do_dealloc(%p)", p);
+    if (!p) return;
+    dealloc_class(p, chunkToClass(p));
+}
+
+// Frees p, allocated for size bytes by do_alloc (align == 0) or by
+// do_aligned_alloc, without looking up its class in the sizemap. Assertion
+// builds check that size matches the chunk.
+static inline void do_sized_dealloc(void* p, size_t size, size_t align) {
+    DEBUG("do_sized_dealloc(%p, %ld, %ld)", p, size, align);
+    if (!p) return;
+    size = std::max(size, 1ul);  // e.g., operator new(0) allocs a byte
+    uint8_t cl = align ? alignedSizeToClass(size, align) :
+            (isLargeAlloc(size) ? 0 : sizeToClass(size));
+#ifndef NASSERT
+    if (unlikely(cl != chunkToClass(p))) {
+        info("ERROR: plsalloc: sized free of %p with size %ld (align %ld), "
+             "but its chunk is of class %d, not %d (app code is likely broken)",
+             p, size, align, chunkToClass(p), cl);
+        std::abort();
+    }
+    if (unlikely(!cl && (size > kMaxTrackedSize || largeChunkRound(size) != largeChunkSize(p)))) {
+        info("ERROR: plsalloc: sized free of %p with size %ld (align %ld), "
+             "but its large chunk has %ld bytes (app code is likely broken)",
+             p, size, align, largeChunkSize(p));
+        std::abort();
+    }
+#endif
+    dealloc_class(p, cl);
+}
+
+// Whether a sized free of p with size bytes (see do_sized_dealloc) would find
+// p's class (and, for large chunks, its size), so realloc can keep p for size
+// bytes
+static inline bool sized_class_matches(void* p, size_t size) {
+    uint8_t cl = chunkToClass(p);
+    if (cl) return !isLargeAlloc(size) && sizeToClass(size) == cl;
+    return isLargeAlloc(size) && size <= kMaxTrackedSize &&
+            largeChunkRound(size) == largeChunkSize(p);
+}
+
 static inline size_t chunk_size(void* p) {
     uint8_t cl = chunkToClass(p);
-    return cl ? classToSize(cl) : gs.largeHeap.chunkToSize_noassert(p);
+    return cl ? classToSize(cl) : largeChunkSize(p);
+}
+
+// Returns the first run of whole pages in [start, end), which must lie in a
+// chunk the caller just allocated, that are known to be zero, or (end, end) if
+// there are none. Only large chunks track zero pages.
+static std::tuple<char*, char*> known_zero_pages(char* start, char* end) {
+    if (chunkToClass(start)) return std::make_tuple(end, end);
+    size_t page = ((start - trackedBase) + kPageSize - 1) >> kPageBits;
+    size_t endPage = (end - trackedBase) >> kPageBits;
+    for (; page < endPage; page++) {
+        if (dirtymap[page]) continue;
+        size_t runEnd = page + 1;
+        while (runEnd < endPage && !dirtymap[runEnd]) runEnd++;
+        return std::make_tuple(trackedBase + (page << kPageBits),
+                               trackedBase + (runEnd << kPageBits));
+    }
+    return std::make_tuple(end, end);
 }
 
 static inline bool valid_chunk(void* p) {
@@ -350,4 +1440,27 @@ static inline bool valid_chunk(void* p) {
     return (ptr >= trackedBase) && (ptr <= gs.trackedBump);
 }
 
+// Flushes the caller's thread cache (or its CPU's slab and cache), reclaims
+// all fully free small-alloc spans, and returns the memory of all free large
+// chunks and spans to the OS. Returns the bytes released.
+static size_t do_trim() {
+    if (unlikely(!__initialized)) return 0;
+#if USE_THREADCACHE
+    ThreadCache* tc = getThreadCache(cacheIdx());
+    if (tc) {
+#if PER_CPU_CACHES
+        scoped_mutex sm(tc->cpuLock());
+        // If we migrate meanwhile, this drains part of another CPU's slab,
+        // which is just as correct
+        for (size_t cl = 1; cl < kMaxClasses; cl++) {
+            while (void* p = gs.slabs.pop(cl)) tc->dealloc(p, cl);
+        }
+#endif
+        tc->flush();
+    }
+#endif
+    for (size_t cl = 1; cl < kMaxClasses; cl++) gs.classLists[cl].reclaimNow();
+    return gs.largeHeap.trim() + gs.spanHeap.trim();
+}
+
 };  // namespace plsalloc
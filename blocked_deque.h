@@ -206,6 +206,38 @@ class BlockedDeque {
             }
         }
 
+        // Detaches the front block and returns it. Invariants:
+        // - Head must be aligned at block granularity
+        // - Must have at least one more block (can't leave an empty list)
+        inline DequeBlock<T>* pop_front_block() {
+            assert(!(phead & DQBLOCK_MASK));
+            DequeBlock<T>* blk = bhead;
+            assert(blk->next);
+            bhead = blk->next;
+            bhead->prev = nullptr;
+            blk->next = nullptr;
+            phead += DQBLOCK_SIZE;
+            return blk;
+        }
+
+        // Adds a full block to the front. Invariants:
+        // - Head must be aligned at block granularity
+        inline void push_front_block(DequeBlock<T>* __restrict__ blk) {
+            blk->prev = nullptr;
+            if (empty()) {
+                blk->next = nullptr;
+                bhead = btail = blk;
+                phead = 0;
+                ptail = DQBLOCK_SIZE;
+            } else {
+                assert(!(phead & DQBLOCK_MASK));
+                blk->next = bhead;
+                bhead->prev = blk;
+                bhead = blk;
+                phead -= DQBLOCK_SIZE;
+            }
+        }
+
         // Steals front block to an empty list. Invariants:
         // - Must have at least one full block.
         inline void steal_front(BlockedDeque<T>& __restrict__ dstList) {
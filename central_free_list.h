@@ -23,6 +23,7 @@
  * this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include "common.h"
 #include "blocked_deque.h"
 #include "mutex.h"
@@ -31,57 +32,196 @@
 
 namespace plsalloc {
 
+/* Lock-free cache of full blocks (batches of DQBLOCK_SIZE elems) in front of a
+ * central freelist, so that thread caches can refill and drain whole blocks
+ * without taking its lock. Each slot holds either null or a full block, and is
+ * filled and emptied with a CAS on the slot itself, so there's no ABA problem.
+ * Smaller fetches that the freelist can't satisfy split a block under the lock.
+ */
+class TransferCache {
+  private:
+    static constexpr int32_t kSlots = 32;
+    DequeBlock<void*>* volatile slots[kSlots];
+    volatile int32_t fullSlots;  // approximate, only used to skip scans
+
+  public:
+    TransferCache() : fullSlots(0) {
+        for (int32_t i = 0; i < kSlots; i++) slots[i] = nullptr;
+    }
+
+    bool put(DequeBlock<void*>* blk) {
+        if (fullSlots >= kSlots) return false;
+        for (int32_t i = 0; i < kSlots; i++) {
+            if (!slots[i] && __sync_bool_compare_and_swap(&slots[i], nullptr, blk)) {
+                __sync_fetch_and_add(&fullSlots, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Scans in the opposite direction of put() to reduce collisions
+    DequeBlock<void*>* get() {
+        if (fullSlots <= 0) return nullptr;
+        for (int32_t i = kSlots - 1; i >= 0; i--) {
+            DequeBlock<void*>* blk = slots[i];
+            if (blk && __sync_bool_compare_and_swap(&slots[i], blk, nullptr)) {
+                __sync_fetch_and_sub(&fullSlots, 1);
+                return blk;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Span sizing. Central freelists start with spans of a few objects (at least
+// a page) and double them on every sysAlloc, up to a huge page. Rarely used
+// classes thus take little memory, and hot ones get large spans.
+static constexpr uint32_t kMinSpanObjs = 4;
+static constexpr uint32_t kMinSpanSize = 32 * 1024;
+static constexpr uint32_t kMaxSpanSize = 2 * 1024 * 1024;
+
+// Classes reclaim fully free spans once they hold this many bytes of them, and
+// these are at least a quarter of their freelists' bytes, so spans aren't
+// handed back and forth with the span heap as a class's use ebbs and flows
+static constexpr uint32_t kMinReclaimSize = 4 * 1024 * 1024;
+
+/* Span freelists. A central freelist keeps the free elems of each span it owns
+ * in a list of the span's own, linked through a side map (see spanLink), and
+ * indexes the spans that have free elems in buckets by how many they have.
+ * Allocs take elems from the fullest spans first, as in mimalloc and TCMalloc,
+ * so live objects concentrate in few spans, and the emptiest ones drain until
+ * they're fully free and can be reclaimed. Elems in thread and transfer caches
+ * are out of the freelists, like allocated ones.
+ */
+
+// Spans with free elems are in bucket log2(free elems), so lower buckets hold
+// fuller spans, except for fully free spans, which are used last
+static constexpr uint32_t kSpanBuckets = 16;
+static constexpr uint32_t kFreeSpanBucket = kSpanBuckets - 1;
+static constexpr uint8_t kNoBucket = 0xff;
+static constexpr uint32_t kNoSpan = ~0u;
+// Partially free spans have fewer free elems than a max-size span of lines
+static_assert((kMaxSpanSize >> 6) <= (1u << kFreeSpanBucket), "free elems must fit in buckets");
+static_assert((kMaxSpanSize >> 6) < (1u << 16), "line offsets in spans must fit in links");
+
+// Freelist state of a small-alloc span, which its owner's lock protects
+struct SpanState {
+    uint32_t prev;       // neighbors in the owner's bucket, as first pages
+    uint32_t next;
+    uint32_t elems;
+    uint32_t freeElems;
+    uint16_t freeHead;   // first free elem, as its line in the span + 1 (0 if none)
+    uint8_t bucket;      // kNoBucket if no elems are free
+    uint8_t bank;        // of the owner, the bank that carved the span
+};
+
 class CentralFreeList {
   private:
     // dsm: Use uint32_t so everything fits in one line
     const uint32_t chunkSize;
-    const uint32_t elemsPerFetch;
-    BlockedDeque<void*> freeChunks;
+    const uint32_t sizeClass;
     char* bumpStart;
     char* bumpEnd;
     mutex lock;
+    uint32_t spanSize;  // of the next sysAlloc'd span
+    uint32_t usedBuckets;  // bitmap of buckets with spans
+    size_t freeElems;
+    size_t freeSpanBytes;  // of fully free spans
+    uint32_t bucketHeads[kSpanBuckets];
+    // All banks of the class (just this one without banks). Frees go to the
+    // bank that owns the elem's span, and banks reclaim spans together.
+    CentralFreeList* const banks;
+    const uint32_t numBanks;
+
+    // Off the lock's line, as it's used without holding the lock
+    TransferCache transferCache ATTR_LINE_ALIGNED;
 
   public:
-    CentralFreeList(uint32_t _chunkSize, uint32_t _elemsPerFetch)
-        : chunkSize(_chunkSize), elemsPerFetch(_elemsPerFetch),
-          bumpStart(nullptr), bumpEnd(nullptr) {}
+    CentralFreeList(uint32_t _chunkSize, uint32_t _sizeClass,
+                    CentralFreeList* _banks = nullptr, uint32_t _numBanks = 1)
+        : chunkSize(_chunkSize), sizeClass(_sizeClass),
+          bumpStart(nullptr), bumpEnd(nullptr),
+          spanSize(std::min(kMaxSpanSize, std::max(kMinSpanSize, kMinSpanObjs * _chunkSize))),
+          usedBuckets(0), freeElems(0), freeSpanBytes(0),
+          banks(_banks ? _banks : this), numBanks(_numBanks) {
+        for (uint32_t b = 0; b < kSpanBuckets; b++) bucketHeads[b] = kNoSpan;
+    }
 
     CentralFreeList() : CentralFreeList(0, 0) {}
 
-    void* alloc() {
+    // With canSysAlloc == false, returns nullptr instead of calling sysAlloc.
+    // Returns nullptr if out of memory.
+    void* alloc(bool canSysAlloc = true) {
+        if (!usedBuckets) splitTransferBlock();  // racy, but just a hint
         scoped_mutex sm(lock);
-        if (!freeChunks.empty()) return freeChunks.dequeue_back();
-        if (unlikely(bumpStart + chunkSize > bumpEnd))
-            std::tie(bumpStart, bumpEnd) = sysAlloc(chunkSize);
+        if (usedBuckets) return pop();
+        if (unlikely(bumpStart + chunkSize > bumpEnd)) {
+            if (!canSysAlloc || !growSpan()) return nullptr;
+        }
         void* res = bumpStart;
         bumpStart += chunkSize;
         assert(bumpStart <= bumpEnd);
+        setPageOwner((char*) res, bumpStart);
         return res;
     }
 
+    // Frees to the bank that owns p's span, which may not be this one
     void dealloc(void* p) {
-        scoped_mutex sm(lock);
-        freeChunks.push_back(p);
+        CentralFreeList& owner = banks[spanState(spanFirstPage(p)).bank];
+        owner.lock.lock();
+        bool spanFreed = owner.push(p);
+        owner.lock.unlock();
+        if (unlikely(spanFreed)) maybeReclaim();
     }
 
-    void bulkAlloc(BlockedDeque<void*>& __restrict__ dstList) {
-        lock.lock();
-        CFDEBUG("bulkAlloc start cs %d  ef %d  fcs %ld", chunkSize, elemsPerFetch,
-             freeChunks.size());
-
-        // Grab from freeChunks ONLY if you can satisfy the whole allocation.
-        // Otherwise, let freeChunks grow from deallocs first.
-        if (freeChunks.size() >= elemsPerFetch) {
-            if (elemsPerFetch >= DQBLOCK_SIZE) {
-                CFDEBUG("CF: Moving full block");
-                freeChunks.steal_front(dstList);
-            } else {
-                for (uint32_t i = 0; i < elemsPerFetch; i++) {
-                    dstList.push_back(freeChunks.dequeue_back());
-                }
+    // Reclaims all fully free spans of the class now, regardless of their
+    // size (e.g., for malloc_trim)
+    void reclaimNow() { reclaim(true); }
+
+    // Hold the locks of all the class's banks across fork() (see lockForFork
+    // in alloc.h), taken in reclaim's order. Children reinitialize them.
+    void lockAll() {
+        for (uint32_t b = 0; b < numBanks; b++) banks[b].lock.lock();
+    }
+
+    void unlockAll(bool reinit) {
+        for (uint32_t b = numBanks; b > 0; b--) {
+            mutex& m = banks[b - 1].lock;
+            reinit ? m.reinit() : m.unlock();
+        }
+    }
+
+    // Fetches up to elemsPerFetch elems (at most DQBLOCK_SIZE) into an empty
+    // dstList. The thread cache picks elemsPerFetch adaptively per class.
+    // With canSysAlloc == false, fetches nothing and returns false instead of
+    // calling sysAlloc. Also returns false if out of memory.
+    bool bulkAlloc(BlockedDeque<void*>& __restrict__ dstList, uint32_t elemsPerFetch,
+                   bool canSysAlloc = true) {
+        assert(elemsPerFetch <= DQBLOCK_SIZE);
+        // Transfer cache blocks hold recently freed elems of any span, so
+        // prefer the fullest spans' elems while there are enough of them.
+        // Otherwise, the blocks would keep recycling the same scattered elems.
+        if (elemsPerFetch == DQBLOCK_SIZE && freeElems < elemsPerFetch) {  // racy, but just a hint
+            DequeBlock<void*>* blk = transferCache.get();
+            if (blk) {
+                CFDEBUG("CF: Transfer cache alloc");
+                dstList.push_front_block(blk);
+                return true;
             }
+        }
+
+        // Blocks in the transfer cache count: smaller fetches split them
+        if (freeElems < elemsPerFetch) splitTransferBlock();  // racy, but just a hint
+        lock.lock();
+        CFDEBUG("bulkAlloc start cs %d  ef %d  fe %ld", chunkSize, elemsPerFetch, freeElems);
+
+        // Grab from the span freelists ONLY if you can satisfy the whole
+        // allocation. Otherwise, let them grow from deallocs first.
+        if (freeElems >= elemsPerFetch) {
+            for (uint32_t i = 0; i < elemsPerFetch; i++) dstList.push_back(pop());
             lock.unlock();
-            return;
+            return true;
         }
 
         // Fallthrough path. For simplicity, allocate either from bump or
@@ -89,9 +229,18 @@ class CentralFreeList {
         // entire allocation (this is rare and simplifies code).
         if (bumpStart + chunkSize <= bumpEnd) {
             CFDEBUG("CF: Bump-pointer alloc");
+        } else if (!canSysAlloc) {
+            lock.unlock();
+            return false;
         } else {
             CFDEBUG("CF: Sys alloc");
-            std::tie(bumpStart, bumpEnd) = sysAlloc(chunkSize);
+            if (unlikely(!growSpan())) {
+                // Out of memory; make do with the (fewer) elems we have
+                bool fetched = freeElems != 0;
+                while (freeElems) dstList.push_back(pop());
+                lock.unlock();
+                return fetched;
+            }
         }
         char* start = bumpStart;
         char* end = bumpEnd;
@@ -105,60 +254,249 @@ class CentralFreeList {
             end = start + chunkSize * availElems;
         }
 
+        setPageOwner(start, end);
         for (char* cur = start; cur < end; cur += chunkSize) {
             dstList.push_back(cur);
         }
+        return true;
     }
 
     void bulkDealloc(BlockedDeque<void*>& __restrict__ srcList, size_t elems) {
         CFDEBUG("bulkDealloc start cs %d el %ld ssz %ld", chunkSize, elems,
                 srcList.size());
         if (elems >= DQBLOCK_SIZE) {
-            // Move entire blocks front-to-front (fronts are always aligned)
-            // NOTE(dsm): We splice source list outside the critical section
+            // Move entire blocks from the front (fronts are always aligned),
+            // to the transfer cache while it has room, and then to the span
+            // freelists
             size_t blocks = elems / DQBLOCK_SIZE;
-            auto spliced = srcList.splice_front(blocks);
             CFDEBUG("bulkDealloc moving %ld full blocks", blocks);
-            lock.lock();
-            freeChunks.merge_front(spliced);
-            lock.unlock();
+            while (blocks--) {
+                DequeBlock<void*>* blk = srcList.pop_front_block();
+                if (transferCache.put(blk)) continue;
+                insert(blk->elems, DQBLOCK_SIZE);
+                DequeBlock<void*>::dealloc(blk);
+            }
         } else {
-            // Move single elems back-to-back
+            // Move single elems from the back
             CFDEBUG("bulkDealloc moving single elems");
-            lock.lock();
-            while (elems--) {
-                freeChunks.push_back(srcList.dequeue_back());
-            }
-            lock.unlock();
+            void* batch[DQBLOCK_SIZE];
+            for (size_t i = 0; i < elems; i++) batch[i] = srcList.dequeue_back();
+            insert(batch, elems);
         }
         CFDEBUG("bulkDealloc done");
     }
+
+  private:
+    // Adds p to its span's freelist. p's span must be ours, and we must hold
+    // the lock. Returns whether this made the span fully free.
+    inline bool push(void* p) {
+        size_t firstPage = spanFirstPage(p);
+        SpanState& s = spanState(firstPage);
+        assert(&banks[s.bank] == this);
+        spanLink(p) = s.freeHead;
+        s.freeHead = (((char*) p - spanStart(firstPage)) >> 6) + 1;
+        s.freeElems++;
+        freeElems++;
+        return rebucket(firstPage, s);
+    }
+
+    // Takes a free elem of the fullest span. Must hold the lock and have free
+    // elems.
+    inline void* pop() {
+        size_t firstPage = bucketHeads[__builtin_ctz(usedBuckets)];
+        SpanState& s = spanState(firstPage);
+        assert(s.freeHead);
+        void* p = spanStart(firstPage) + ((size_t) (s.freeHead - 1) << 6);
+        s.freeHead = spanLink(p);
+        s.freeElems--;
+        freeElems--;
+        rebucket(firstPage, s);
+        return p;
+    }
+
+    // Moves the span to the bucket of its free elems (at its head, so allocs
+    // keep taking elems from the span until it's full). Returns whether the
+    // span just became fully free.
+    inline bool rebucket(size_t firstPage, SpanState& s) {
+        uint8_t bucket = kNoBucket;
+        if (s.freeElems == s.elems) bucket = kFreeSpanBucket;
+        else if (s.freeElems) bucket = 31 - __builtin_clz(s.freeElems);
+        if (likely(bucket == s.bucket)) return false;
+
+        if (s.bucket != kNoBucket) {
+            if (s.prev != kNoSpan) spanState(s.prev).next = s.next;
+            else bucketHeads[s.bucket] = s.next;
+            if (s.next != kNoSpan) spanState(s.next).prev = s.prev;
+            if (bucketHeads[s.bucket] == kNoSpan) usedBuckets &= ~(1u << s.bucket);
+            if (s.bucket == kFreeSpanBucket) freeSpanBytes -= spanBytes(firstPage);
+        }
+        s.bucket = bucket;
+        if (bucket == kNoBucket) return false;
+        s.prev = kNoSpan;
+        s.next = bucketHeads[bucket];
+        if (s.next != kNoSpan) spanState(s.next).prev = firstPage;
+        bucketHeads[bucket] = firstPage;
+        usedBuckets |= 1u << bucket;
+        if (bucket != kFreeSpanBucket) return false;
+        freeSpanBytes += spanBytes(firstPage);
+        return true;
+    }
+
+    // Adds elems of any bank's spans to their owners' freelists, taking each
+    // owner's lock once. Must not hold any bank's lock.
+    void insert(void* const* elems, size_t n) {
+        assert(n <= DQBLOCK_SIZE);
+        uint8_t owners[DQBLOCK_SIZE];
+        for (size_t i = 0; i < n; i++) owners[i] = spanState(spanFirstPage(elems[i])).bank;
+        bool spanFreed = false;
+        for (uint32_t b = 0; b < numBanks; b++) {
+            CentralFreeList& bank = banks[b];
+            bool locked = false;
+            for (size_t i = 0; i < n; i++) {
+                if (owners[i] != b) continue;
+                if (!locked) {
+                    bank.lock.lock();
+                    locked = true;
+                }
+                spanFreed |= bank.push(elems[i]);
+            }
+            if (locked) bank.lock.unlock();
+        }
+        if (unlikely(spanFreed)) maybeReclaim();
+    }
+
+    // Moves a block from the transfer cache to the span freelists. Must not
+    // hold the lock. Returns false if the transfer cache is empty.
+    bool splitTransferBlock() {
+        DequeBlock<void*>* blk = transferCache.get();
+        if (!blk) return false;
+        CFDEBUG("CF: Splitting transfer cache block");
+        insert(blk->elems, DQBLOCK_SIZE);
+        DequeBlock<void*>::dealloc(blk);
+        return true;
+    }
+
+    // Replaces the bump region with a new span, which this bank owns. Must
+    // hold the lock. Returns false (keeping the bump region) if out of memory.
+    bool growSpan() {
+        char* start;
+        char* end;
+        std::tie(start, end) = sysAlloc(std::max(spanSize, chunkSize), sizeClass);
+        if (unlikely(!start)) return false;
+        spanState(spanFirstPage(start)).bank = this - banks;
+        bumpStart = start;
+        bumpEnd = end;
+        spanSize = std::min(2 * spanSize, kMaxSpanSize);
+        return true;
+    }
+
+    // Whether the class's fully free spans are worth reclaiming. Reads other
+    // banks' state without their locks, which is fine for a heuristic.
+    bool shouldReclaim() const {
+        size_t spanBytes = 0;
+        size_t freeBytes = 0;
+        for (uint32_t b = 0; b < numBanks; b++) {
+            spanBytes += banks[b].freeSpanBytes;
+            freeBytes += banks[b].freeElems * chunkSize;
+        }
+        return spanBytes >= kMinReclaimSize && spanBytes >= freeBytes / 4;
+    }
+
+    // Must not hold the lock
+    void maybeReclaim() {
+        if (shouldReclaim()) reclaim(false);
+    }
+
+    // Reclaims the class's fully free spans across all banks, if worth it or
+    // with force. Holds all the banks' locks (taken in order, so concurrent
+    // reclaims don't deadlock), so transfer cache blocks can join the
+    // freelists of any bank first, and their spans be reclaimed too.
+    void reclaim(bool force) {
+        for (uint32_t b = 0; b < numBanks; b++) banks[b].lock.lock();
+        BlockedDeque<void*> spans;
+        spans.init();
+        if (force || shouldReclaim()) {
+            CFDEBUG("CF: Reclaiming, class %d", sizeClass);
+            for (uint32_t b = 0; b < numBanks; b++) {
+                while (DequeBlock<void*>* blk = banks[b].transferCache.get()) {
+                    for (void* p : blk->elems) banks[spanState(spanFirstPage(p)).bank].push(p);
+                    DequeBlock<void*>::dealloc(blk);
+                }
+            }
+            for (uint32_t b = 0; b < numBanks; b++) banks[b].takeFreeSpans(spans);
+        }
+        for (uint32_t b = 0; b < numBanks; b++) banks[b].lock.unlock();
+        donateFreeSpans(spans);
+    }
+
+    // Removes all fully free spans from the index, adding them to spans. Must
+    // hold the lock.
+    void takeFreeSpans(BlockedDeque<void*>& spans) {
+        while (bucketHeads[kFreeSpanBucket] != kNoSpan) {
+            size_t firstPage = bucketHeads[kFreeSpanBucket];
+            SpanState& s = spanState(firstPage);
+            freeElems -= s.freeElems;
+            s.freeElems = 0;
+            s.freeHead = 0;
+            rebucket(firstPage, s);
+            spans.push_back(spanStart(firstPage));
+        }
+    }
 } ATTR_LINE_ALIGNED;
 
+// Threads in the same tile (2^kBankTileBits consecutive tids) share a bank
+static constexpr uint32_t kBankTileBits = 2;
+
+/* Banked central freelists reduce lock contention. Threads use the bank of
+ * their tile, so chunks tend to stay near the cores that use them. When the home
+ * bank would have to sysAlloc, threads first steal from neighboring banks, so
+ * banking doesn't take much extra capacity.
+ */
 template <size_t NB> class BankedCentralFreeList {
     private:
+        static_assert(NB <= 256, "bank ids must fit in span states");
         CentralFreeList banks[NB];
-        inline size_t rb() {
-            uint64_t randVal;
-            sim_rdrand(&randVal);
-            return randVal % NB;
+
+        static inline size_t homeBank() {
+            return (sim_get_tid() >> kBankTileBits) % NB;
         }
 
     public:
-        BankedCentralFreeList(uint32_t _chunkSize, uint32_t _elemsPerFetch) {
+        BankedCentralFreeList(uint32_t _chunkSize, uint32_t _sizeClass) {
             for (size_t b = 0; b < NB; b++)
-                new (&banks[b]) CentralFreeList(_chunkSize, _elemsPerFetch);
+                new (&banks[b]) CentralFreeList(_chunkSize, _sizeClass, banks, NB);
+        }
+
+        inline void* alloc() {
+            size_t home = homeBank();
+            void* res = banks[home].alloc(false);
+            for (size_t d = 1; !res && d < NB; d++) {
+                res = banks[(home + d) % NB].alloc(false);
+            }
+            return res ? res : banks[home].alloc(true);
         }
 
-        inline void* alloc() { return banks[rb()].alloc(); }
-        inline void dealloc(void* p) { banks[rb()].dealloc(); }
+        // Any bank frees to the owner of p's span
+        inline void dealloc(void* p) { banks[0].dealloc(p); }
+
+        // Any bank reclaims for all of them
+        inline void reclaimNow() { banks[0].reclaimNow(); }
 
-        inline void bulkAlloc(BlockedDeque<void*>& __restrict__ dstList) {
-            banks[rb()].bulkAlloc(dstList);
+        // Any bank locks all of them
+        void lockAll() { banks[0].lockAll(); }
+        void unlockAll(bool reinit) { banks[0].unlockAll(reinit); }
+
+        inline bool bulkAlloc(BlockedDeque<void*>& __restrict__ dstList, uint32_t elemsPerFetch) {
+            size_t home = homeBank();
+            if (banks[home].bulkAlloc(dstList, elemsPerFetch, false)) return true;
+            for (size_t d = 1; d < NB; d++) {
+                if (banks[(home + d) % NB].bulkAlloc(dstList, elemsPerFetch, false)) return true;
+            }
+            return banks[home].bulkAlloc(dstList, elemsPerFetch, true);
         }
 
         inline void bulkDealloc(BlockedDeque<void*>& __restrict__ srcList, size_t elems) {
-            banks[rb()].bulkDealloc(srcList, elems);
+            banks[homeBank()].bulkDealloc(srcList, elems);
         }
 };
 
@@ -31,9 +31,14 @@
 #include <tuple>
 
 // Define info/warn macros and include hooks only if this isn't being used from
-// the simulator.
+// the simulator. PLSALLOC_NATIVE replaces the simulator hooks with a native
+// Linux backend.
 #ifndef PLSALLOC_INCLUDED_FROM_SIM
+#ifdef PLSALLOC_NATIVE
+#include "native_hooks.h"
+#else
 #include "swarm/hooks.h"
+#endif
 
 #define likely(x) __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
@@ -69,6 +74,37 @@ static void __plsalloc_assert_fail(const char* file, size_t line) {
 #endif  // PLSALLOC_INCLUDED_FROM_SIM
 
 /* System allocator interface, used all over the place */
+template <class T> class BlockedDeque;
+
 namespace plsalloc {
-static std::tuple<char*, char*> sysAlloc(size_t chunkSize);
+// Returns a span of at least size bytes (rounded up to whole pages, or to a
+// minimum span size for large allocs), whose pages the sizemap maps to class
+// cl (0 for large-alloc pages). Returns (nullptr, nullptr) if out of memory.
+static std::tuple<char*, char*> sysAlloc(size_t size, uint8_t cl);
+// Central freelists call this when they carve [start, end) out of a fresh span
+// for the calling thread, which then owns those pages
+static void setPageOwner(char* start, char* end);
+// Large-alloc pages record which LargeHeap shard manages them
+static void setLargeHeapShard(char* start, char* end, uint8_t shard);
+static uint8_t largeHeapShard(void* p);
+// Records the size of an allocated large chunk for lock-free lookups (0 clears)
+static void setLargeChunkSize(char* chunk, size_t size);
+// Large heaps track which pages may hold nonzero data, so calloc can skip the
+// rest: freeing a chunk dirties every page it overlaps, and returning memory to
+// the OS cleans the pages fully within it
+static void setPagesDirty(char* start, char* end, bool dirty);
+// Returns the dirty pages fully within [start, end) to the OS and marks them
+// clean. Returns the bytes released, so pages released earlier don't count.
+static size_t releasePages(char* start, char* end);
+// Small-alloc spans and their freelist state (see CentralFreeList). Spans are
+// identified by their first page.
+struct SpanState;
+static inline size_t spanFirstPage(void* p);
+static inline size_t spanBytes(size_t firstPage);
+static inline char* spanStart(size_t firstPage);
+static inline SpanState& spanState(size_t firstPage);
+static inline uint16_t& spanLink(void* p);
+// Returns fully free spans, removed from their central freelists, for reuse by
+// any class
+static void donateFreeSpans(BlockedDeque<void*>& spans);
 };
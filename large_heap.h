@@ -23,14 +23,18 @@
  * this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <map>
+#include <sys/mman.h>
 #include <unordered_set>
 #include "common.h"
 #include "mutex.h"
 #include "stl_untracked_alloc.h"
 
-/* Manages all large-alloc (class 0) pages. Aims for compact storage and space
- * efficiency by merging blocks aggressively.
+/* Manages large-alloc (class 0) pages. Aims for compact storage and space
+ * efficiency by merging blocks aggressively, and returns the memory of free
+ * chunks to the OS beyond a budget. ShardedLargeHeap splits the pages among
+ * several of these.
  */
 
 #define LHDEBUG(args...) //info(args)
@@ -41,33 +45,78 @@ namespace plsalloc {
 template <typename K, typename V> class u_map : public std::map<K, V, std::less<K>, StlUntrackedAlloc<std::pair<const K, V> > > {};
 template <typename K> class u_unordered_set : public std::unordered_set<K, std::hash<K>, std::equal_to<K>, StlUntrackedAlloc<K> > {};
 
+// Each heap keeps about this many bytes of freed memory committed, so that
+// programs that repeatedly alloc and free large chunks reuse them without
+// faulting pages back in. Beyond it, frees return the pages they freed to the
+// OS right away. trim() returns the rest.
+static constexpr size_t kMaxRetainedBytes = 32ul << 20;
+
 class LargeHeap {
     private:
         u_map<size_t, u_unordered_set<char*>> freeChunkSets;
         u_map<char*, size_t> chunkSizes;
         mutable mutex lock;
+        const uint8_t shard;
+        // Freed bytes that may still be committed: grows as chunks are freed,
+        // and shrinks as they're reused or released. Only approximate, since
+        // reuse can't tell released pages from committed ones.
+        size_t retainedBytes;
 
     public:
-        void* alloc(size_t chunkSize) {
-            scoped_mutex sm(lock);
-            // Best-fit allocation
-            auto fit = freeChunkSets.lower_bound(chunkSize);
-            char* start;
-            char* end;
+        LargeHeap(uint8_t _shard = 0) : shard(_shard), retainedBytes(0) {}
 
-            if (fit == freeChunkSets.end()) {
-                LHDEBUG("LH: invoking sysAlloc");
-                std::tie(start, end) = sysAlloc(chunkSize);
-            } else {
-                LHDEBUG("LH: chunkSet[%ld] alloc %ld", fit->first, chunkSize);
+        // Returns a chunk aligned to align (a power of 2, at least a line), or
+        // nullptr if out of memory. With canSysAlloc == false, returns nullptr
+        // instead of calling sysAlloc.
+        void* alloc(size_t chunkSize, size_t align = CACHE_LINE_BYTES,
+                    bool canSysAlloc = true) {
+            assert(align >= CACHE_LINE_BYTES && !(align & (align - 1)));
+            scoped_mutex sm(lock);
+            // Best-fit allocation. Line-aligned requests fit in any chunk of
+            // the first set; others may need to look further.
+            char* start = nullptr;
+            char* end = nullptr;
+            for (auto fit = freeChunkSets.lower_bound(chunkSize);
+                 fit != freeChunkSets.end(); fit++) {
                 auto& chunkSet = fit->second;
                 auto cit = chunkSet.begin();
+                if (fit->first < chunkSize + align - CACHE_LINE_BYTES) {
+                    // Not every chunk fits
+                    for (; cit != chunkSet.end(); cit++) {
+                        if (alignUp(*cit, align) + chunkSize <= *cit + fit->first) break;
+                    }
+                    if (cit == chunkSet.end()) continue;
+                }
+                LHDEBUG("LH: chunkSet[%ld] alloc %ld", fit->first, chunkSize);
                 start = *cit;
                 end = start + fit->first;
                 chunkSet.erase(cit);
                 if (chunkSet.empty()) freeChunkSets.erase(fit);
+                retainedBytes -= std::min(retainedBytes, chunkSize);
+                break;
             }
-            chunkSizes[start] = chunkSize;
+
+            if (!start) {
+                if (!canSysAlloc) return nullptr;
+                LHDEBUG("LH: invoking sysAlloc");
+                // Spans are page-aligned, so this overshoots (harmlessly)
+                std::tie(start, end) = sysAlloc(chunkSize + align - CACHE_LINE_BYTES, 0);
+                if (unlikely(!start)) return nullptr;
+                // Pages default to shard 0
+                if (shard) setLargeHeapShard(start, end, shard);
+            }
+
+            // Free the unaligned prefix, if any. It can merge with the previous
+            // chunk, but not with ours, which is not free.
+            char* alignedStart = alignUp(start, align);
+            chunkSizes[alignedStart] = chunkSize;
+            if (alignedStart != start) {
+                LHDEBUG("LH: prefix %p %ld", start, alignedStart - start);
+                chunkSizes[start] = alignedStart - start;
+                unlocked_dealloc(start);
+                start = alignedStart;
+            }
+            setLargeChunkSize(start, chunkSize);
 
             char* left = start + chunkSize;
             size_t remaining = end - left;
@@ -81,14 +130,86 @@ class LargeHeap {
         }
 
         void dealloc(void* p) {
+            setLargeChunkSize((char*) p, 0);
+            scoped_mutex sm(lock);
+            char* chunk = (char*) p;
+            auto it = chunkSizes.find(chunk);
+            size_t chunkSize = (it != chunkSizes.end()) ? it->second : 0;
+            unlocked_dealloc(chunk, true);  // aborts if untracked
+            // Must hold the lock, or someone could allocate the chunk first
+            retain(chunk, chunkSize);
+        }
+
+        // Grows or shrinks an allocated chunk in place, to newSize (line-
+        // aligned, and at least a page). Grows by absorbing the next chunk if
+        // it's free and large enough; shrinks by freeing the tail. Returns
+        // false if the chunk can't grow in place.
+        bool resize(void* p, size_t newSize) {
+            scoped_mutex sm(lock);
+            char* chunk = (char*) p;
+            auto it = chunkSizes.find(chunk);
+            if (it == chunkSizes.end()) {
+                info("ERROR: LargeHeap::resize: %p is not a tracked chunk (app code is likely broken)", p);
+                std::abort();
+            }
+            size_t chunkSize = it->second;
+            if (newSize == chunkSize) return true;
+
+            if (newSize > chunkSize) {
+                auto nit = std::next(it);
+                if (nit == chunkSizes.end() || nit->first != chunk + chunkSize) return false;
+                size_t nextChunkSize = nit->second;
+                if (chunkSize + nextChunkSize < newSize) return false;
+                if (!eraseFree(nit->first, nextChunkSize)) return false;
+                LHDEBUG("LH: grow in place %p %ld -> %ld", chunk, chunkSize, newSize);
+                chunkSizes.erase(nit);
+                chunkSize += nextChunkSize;
+                retainedBytes -= std::min(retainedBytes, nextChunkSize);
+            }
+
+            // Free the tail, if any (may merge with the next chunk)
+            it->second = newSize;
+            setLargeChunkSize(chunk, newSize);
+            if (chunkSize > newSize) {
+                char* tail = chunk + newSize;
+                size_t tailSize = chunkSize - newSize;
+                chunkSizes[tail] = tailSize;
+                unlocked_dealloc(tail, true);
+                retain(tail, tailSize);
+            }
+            return true;
+        }
+
+        // Adds a free chunk that was not allocated from this heap
+        void donate(char* chunk, size_t chunkSize) {
             scoped_mutex sm(lock);
-            unlocked_dealloc(p);
+            chunkSizes[chunk] = chunkSize;
+            unlocked_dealloc(chunk, true);
+            retain(chunk, chunkSize);
         }
 
+        // Returns the memory of all free chunks to the OS. Returns the bytes
+        // released, which excludes memory that was already released.
+        size_t trim() {
+            scoped_mutex sm(lock);
+            size_t released = 0;
+            for (auto& fit : freeChunkSets) {
+                for (char* chunk : fit.second) released += release(chunk, fit.first);
+            }
+            retainedBytes = 0;
+            return released;
+        }
+
+        // Hold the lock across fork() (see lockForFork in alloc.h). Children
+        // reinitialize it.
+        void lockAll() { lock.lock(); }
+        void unlockAll(bool reinit) { reinit ? lock.reinit() : lock.unlock(); }
+
         // The only guarantees we have at this point is that chunk isn't
         // invalid memory, but the task may use a stale pointer that doesn't
         // exist anymore. Return a size of 0 in these cases (and don't trigger
-        // an assertion).
+        // an assertion). The allocator itself uses the lock-free large chunk
+        // map instead.
         size_t chunkToSize_noassert(void* chunk) const {
             scoped_mutex sm(lock);
             auto it = chunkSizes.find((char*)chunk);
@@ -97,7 +218,43 @@ class LargeHeap {
         }
 
     private:
-        void unlocked_dealloc(void* p) {
+        // Removes the chunk from freeChunkSets. Returns false if it's not free.
+        bool eraseFree(char* chunk, size_t chunkSize) {
+            auto fit = freeChunkSets.find(chunkSize);
+            if (fit == freeChunkSets.end()) return false;
+            auto& chunkSet = fit->second;
+            auto cit = chunkSet.find(chunk);
+            if (cit == chunkSet.end()) return false;
+            chunkSet.erase(cit);
+            if (chunkSet.empty()) freeChunkSets.erase(fit);
+            return true;
+        }
+
+        static inline char* alignUp(char* p, size_t align) {
+            return (char*) (((uintptr_t) p + align - 1) & ~(align - 1));
+        }
+
+        // Drops the dirty pages fully within the chunk. They read as zero and
+        // are backed by fresh memory when next touched.
+        static size_t release(char* chunk, size_t chunkSize) {
+            LHDEBUG("LH: releasing %p %ld", chunk, chunkSize);
+            return releasePages(chunk, chunk + chunkSize);
+        }
+
+        // Accounts for a just-freed chunk (which may have merged since), and
+        // releases its pages if the heap retains too much freed memory. Only
+        // the chunk's own pages are released, so a free costs about as much
+        // as the chunk, not as the free chunk it merged into.
+        void retain(char* chunk, size_t chunkSize) {
+            retainedBytes += chunkSize;
+            if (retainedBytes > kMaxRetainedBytes) {
+                retainedBytes -= std::min(retainedBytes, release(chunk, chunkSize));
+            }
+        }
+
+        // Frees and merges the chunk, and returns the resulting free chunk.
+        // Chunks that held data (dirty) mark their pages as such.
+        std::tuple<char*, size_t> unlocked_dealloc(void* p, bool dirty = false) {
             LHDEBUG("LH: dealloc(%p)", p);
             char* chunk = (char*) p;
             auto it = chunkSizes.find(chunk);
@@ -106,6 +263,7 @@ class LargeHeap {
                 std::abort();
             }
             size_t chunkSize = it->second;
+            if (dirty) setPagesDirty(chunk, chunk + chunkSize, true);
 
             // Try to merge with previous
             if (it != chunkSizes.begin()) {
@@ -178,7 +336,61 @@ class LargeHeap {
                 fit->second.insert(chunk);
             }
             LHDEBUG("LH: dealloc done");
+            return std::make_tuple(chunk, chunkSize);
         }
 } ATTR_LINE_ALIGNED;
 
+/* Sharded large heaps reduce lock contention. Each shard manages (and merges)
+ * only the spans it sysAllocs, and frees go to the shard that manages the
+ * chunk. Threads allocate from their home shard, and try others before
+ * growing it. But free chunks of different shards never merge, even when
+ * adjacent, so a request that no single shard's chunks fit grows the heap
+ * even if enough memory is free overall. This fragmentation is the price of
+ * the lower contention.
+ */
+template <size_t NS> class ShardedLargeHeap {
+    private:
+        LargeHeap shards[NS];
+
+        static inline size_t homeShard() { return sim_get_tid() % NS; }
+
+    public:
+        ShardedLargeHeap() {
+            for (size_t s = 0; s < NS; s++) new (&shards[s]) LargeHeap(s);
+        }
+
+        void* alloc(size_t chunkSize, size_t align = CACHE_LINE_BYTES) {
+            size_t home = homeShard();
+            void* res = shards[home].alloc(chunkSize, align, false);
+            for (size_t d = 1; !res && d < NS; d++) {
+                res = shards[(home + d) % NS].alloc(chunkSize, align, false);
+            }
+            return res ? res : shards[home].alloc(chunkSize, align, true);
+        }
+
+        void dealloc(void* p) { shards[largeHeapShard(p)].dealloc(p); }
+
+        bool resize(void* p, size_t newSize) {
+            return shards[largeHeapShard(p)].resize(p, newSize);
+        }
+
+        size_t chunkToSize_noassert(void* chunk) const {
+            return shards[largeHeapShard(chunk)].chunkToSize_noassert(chunk);
+        }
+
+        size_t trim() {
+            size_t released = 0;
+            for (size_t s = 0; s < NS; s++) released += shards[s].trim();
+            return released;
+        }
+
+        void lockAll() {
+            for (size_t s = 0; s < NS; s++) shards[s].lockAll();
+        }
+
+        void unlockAll(bool reinit) {
+            for (size_t s = NS; s > 0; s--) shards[s - 1].unlockAll(reinit);
+        }
+};
+
 };
@@ -27,6 +27,9 @@
 
 #include <stdint.h>
 #include <xmmintrin.h>
+#ifdef PLSALLOC_NATIVE
+#include <sched.h>
+#endif
 
 /* TICKET LOCK: Provides FIFO ordering for fairness.
  * WARNING: Will not work with more than 64K threads
@@ -55,9 +58,20 @@ static inline void ticket_lock(volatile uint32_t* lock) {
 
     uint32_t ticket = val & TICKET_MASK;
 
+#ifdef PLSALLOC_NATIVE
+    // Native threads can be descheduled while holding or waiting for the lock,
+    // and with FIFO handoff spinning can't make progress then. Yield the core
+    // after a short spin.
+    uint32_t spins = 0;
+    while ((((*lock) >> 16) & TICKET_MASK) != ticket) {
+        if (++spins > 64) sched_yield();
+        else _mm_pause();
+    }
+#else
     while ((((*lock) >> 16) & TICKET_MASK) != ticket) {
         _mm_pause();
     }
+#endif
 }
 
 static inline int ticket_trylock(volatile uint32_t* lock) {
@@ -81,6 +95,9 @@ class mutex {
         void lock() { ticket_lock(&tlock); }
         void unlock() { ticket_unlock(&tlock); }
         bool trylock() { return ticket_trylock(&tlock); }
+        // Unlocks a lock that others may still hold tickets for, which must
+        // never be served (e.g., threads that are gone after fork)
+        void reinit() { ticket_init(&tlock); }
 };
 
 class scoped_mutex {
@@ -0,0 +1,308 @@
+/** $lic$
+ * Copyright (C) 2017-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of plsalloc.
+ *
+ * plsalloc is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * plsalloc was developed as part of the Swarm architecture project. If you use
+ * this software in your research, we request that you reference the Swarm
+ * MICRO 2018 paper ("Harmonizing Speculative and Non-Speculative Execution in
+ * Architectures for Ordered Parallelism", Jeffrey et al., MICRO-51, 2018) as
+ * the source of plsalloc in any publications that use this software, and that
+ * you send us a citation of your work.
+ *
+ * plsalloc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Native Linux implementation of the swarm/hooks.h primitives plsalloc uses,
+ * so that the allocator can run (and be profiled) outside the simulator.
+ * Selected at build time by defining PLSALLOC_NATIVE.
+ *
+ * Everything here runs underneath malloc, so none of it may allocate from the
+ * heap. Globals are zero-initialized PODs so they are usable before any
+ * constructor runs.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "mutex.h"
+
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>  // glibc >= 2.35 registers rseq for every thread
+#define NATIVE_HAVE_RSEQ 1
+#endif
+
+#define NATIVE_TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* Magic ops. Only stdout writes have a native meaning. */
+
+#define MAGIC_OP_WRITE_STD_OUT (1ul)
+
+static inline void sim_magic_op_1(uint64_t op, uint64_t arg) {
+    if (op == MAGIC_OP_WRITE_STD_OUT) {
+        // Use write() directly; stdio may allocate
+        const char* str = reinterpret_cast<const char*>(arg);
+        ssize_t res = write(STDOUT_FILENO, str, strlen(str));
+        res = write(STDOUT_FILENO, "\n", 1);
+        (void) res;
+    }
+}
+
+/* Privilege and speculation hooks. Native code never runs speculatively: every
+ * task is irrevocable and nothing is ever aborted.
+ */
+
+static inline void sim_priv_call() {}
+static inline void sim_priv_ret() {}
+static inline bool sim_priv_isdoomed() { return false; }
+static inline bool sim_isirrevocable() { return true; }
+static inline void sim_serialize() {}
+
+/* Random numbers (xorshift64*, per thread) */
+
+static NATIVE_TLS uint64_t __native_randState;
+
+static inline void sim_rdrand(uint64_t* val) {
+    uint64_t x = __native_randState;
+    if (__builtin_expect(!x, 0)) x = (uint64_t) &__native_randState ^ __builtin_ia32_rdtsc();
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    __native_randState = x;
+    *val = x * 0x2545f4914f6cdd1dul;
+}
+
+/* Untracked memory. A small segregated-fit heap for allocator metadata
+ * (DequeBlocks and LargeHeap's STL containers). Requests are rounded up to a
+ * power of two and kept in per-size freelists refilled from mmap'd arenas;
+ * requests beyond the largest bin are mmap'd directly. Each chunk carries a
+ * 16-byte header with its bin (or its mapping size), which preserves 16-byte
+ * alignment.
+ */
+
+namespace native {
+
+static constexpr size_t kMinBinBits = 4;   // 16 bytes
+static constexpr size_t kMaxBinBits = 20;  // 1 MB
+static constexpr size_t kNumBins = kMaxBinBits - kMinBinBits + 1;
+static constexpr size_t kArenaSize = 4ul << 20;
+static constexpr size_t kHeaderSize = 16;
+
+struct FreeChunk {
+    FreeChunk* next;
+};
+
+static volatile uint32_t untrackedLock;  // zero == unlocked ticket lock
+static FreeChunk* untrackedBins[kNumBins];
+static char* arenaBump;
+static char* arenaEnd;
+
+static inline size_t sizeToBin(size_t sz) {
+    size_t bits = 64 - __builtin_clzl(std::max(sz, 1ul << kMinBinBits) - 1);
+    return bits - kMinBinBits;
+}
+
+static void* mapUntracked(size_t sz) {
+    void* mem = mmap(nullptr, sz, (PROT_READ|PROT_WRITE), (MAP_PRIVATE|MAP_ANONYMOUS), -1, 0);
+    return (mem == MAP_FAILED) ? nullptr : mem;
+}
+
+};  // namespace native
+
+static inline void* sim_zero_cycle_untracked_malloc(size_t sz) {
+    using namespace native;
+    size_t totalSz = sz + kHeaderSize;
+    uint64_t* hdr;
+    if (__builtin_expect(totalSz > (1ul << kMaxBinBits), 0)) {
+        size_t mapSz = (totalSz + 4095ul) & ~4095ul;
+        hdr = (uint64_t*) mapUntracked(mapSz);
+        if (!hdr) return nullptr;
+        hdr[0] = mapSz;
+    } else {
+        size_t bin = sizeToBin(totalSz);
+        ticket_lock(&untrackedLock);
+        FreeChunk* chunk = untrackedBins[bin];
+        if (chunk) {
+            untrackedBins[bin] = chunk->next;
+        } else {
+            size_t binSz = 1ul << (bin + kMinBinBits);
+            if (__builtin_expect(arenaBump + binSz > arenaEnd, 0)) {
+                // Abandon the arena's tail; it is at most one max-size bin
+                char* arena = (char*) mapUntracked(kArenaSize);
+                if (!arena) {
+                    ticket_unlock(&untrackedLock);
+                    return nullptr;
+                }
+                arenaBump = arena;
+                arenaEnd = arena + kArenaSize;
+            }
+            chunk = (FreeChunk*) arenaBump;
+            arenaBump += binSz;
+        }
+        ticket_unlock(&untrackedLock);
+        hdr = (uint64_t*) chunk;
+        hdr[0] = bin;
+    }
+    return ((char*) hdr) + kHeaderSize;
+}
+
+static inline void sim_zero_cycle_free(void* p) {
+    using namespace native;
+    uint64_t* hdr = (uint64_t*) (((char*) p) - kHeaderSize);
+    size_t binOrSize = hdr[0];
+    if (__builtin_expect(binOrSize >= kNumBins, 0)) {
+        munmap(hdr, binOrSize);
+    } else {
+        FreeChunk* chunk = (FreeChunk*) hdr;
+        ticket_lock(&untrackedLock);
+        chunk->next = untrackedBins[binOrSize];
+        untrackedBins[binOrSize] = chunk;
+        ticket_unlock(&untrackedLock);
+    }
+}
+
+/* Thread ids. Each thread takes a dense id on its first call; ids of exited
+ * threads (detected through a pthread key destructor) are recycled, so the id
+ * space is bounded by the number of live threads. The allocator can register
+ * tidExitHook to release per-thread state before an id is recycled.
+ */
+
+namespace native {
+
+// Must not exceed plsalloc::kMaxThreads
+static constexpr uint32_t kMaxTids = 1u << 16;
+static constexpr uint32_t kInvalidTid = ~0u;
+
+static NATIVE_TLS uint32_t curTid = kInvalidTid;
+
+static volatile uint32_t tidLock;
+static bool tidKeyCreated;
+static pthread_key_t tidKey;
+static uint32_t nextTid;
+static uint32_t freeTids[kMaxTids];
+static uint32_t numFreeTids;
+static void (*tidExitHook)(uint32_t tid);
+
+static void releaseTid(void* keyVal) {
+    uint32_t tid = (uint32_t) (uintptr_t) keyVal - 1;
+    if (tidExitHook) tidExitHook(tid);
+    curTid = kInvalidTid;
+    ticket_lock(&tidLock);
+    freeTids[numFreeTids++] = tid;
+    ticket_unlock(&tidLock);
+}
+
+static uint32_t acquireTid() {
+    ticket_lock(&tidLock);
+    if (!tidKeyCreated) {
+        // NOTE: pthread_key_create does not allocate
+        if (pthread_key_create(&tidKey, releaseTid) != 0) std::abort();
+        tidKeyCreated = true;
+    }
+    uint32_t tid;
+    if (numFreeTids) {
+        tid = freeTids[--numFreeTids];
+    } else if (nextTid < kMaxTids) {
+        tid = nextTid++;
+    } else {
+        ticket_unlock(&tidLock);
+        sim_magic_op_1(MAGIC_OP_WRITE_STD_OUT,
+                reinterpret_cast<uint64_t>("ERROR: plsalloc: too many live threads"));
+        std::abort();
+    }
+    ticket_unlock(&tidLock);
+
+    // Destructors run only on non-null values, so store tid + 1
+    pthread_setspecific(tidKey, (void*) (uintptr_t) (tid + 1));
+    curTid = tid;
+    return tid;
+}
+
+};  // namespace native
+
+/* CPU ids, for per-CPU caches. With rseq, the kernel keeps the current CPU in
+ * the thread's rseq area, so reading it is a single load. Fall back to
+ * sched_getcpu() if rseq is unavailable or unregistered.
+ */
+
+namespace native {
+
+static inline uint32_t curCpu() {
+#ifdef NATIVE_HAVE_RSEQ
+    if (__builtin_expect(__rseq_size != 0, 1)) {
+        const struct rseq* rs = (const struct rseq*)
+                ((char*) __builtin_thread_pointer() + __rseq_offset);
+        int32_t cpu = (int32_t) __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (__builtin_expect(cpu >= 0, 1)) return cpu;
+    }
+#endif
+    int cpu = sched_getcpu();
+    return (cpu >= 0) ? cpu : 0;
+}
+
+};  // namespace native
+
+/* Fork safety. The child starts with only the forking thread, so a lock that
+ * another thread held at fork would stay held forever. The handlers take every
+ * lock first (the allocator's through its hooks, then this file's, which nest
+ * inside them). The parent then releases them. The child reinitializes them
+ * instead: with ticket locks, threads that were waiting hold tickets that
+ * would never be served.
+ */
+
+namespace native {
+
+static void (*forkLockHook)();
+static void (*forkUnlockHook)(bool child);
+
+static void forkPrepare() {
+    forkLockHook();
+    ticket_lock(&tidLock);
+    ticket_lock(&untrackedLock);
+}
+
+static void forkParent() {
+    ticket_unlock(&untrackedLock);
+    ticket_unlock(&tidLock);
+    forkUnlockHook(false);
+}
+
+static void forkChild() {
+    ticket_init(&untrackedLock);
+    ticket_init(&tidLock);
+    forkUnlockHook(true);
+}
+
+// Call once the allocator serves requests, since pthread_atfork may allocate.
+// If it fails, forking while other threads allocate may hang the child.
+static void registerForkHandlers(void (*lockHook)(), void (*unlockHook)(bool child)) {
+    forkLockHook = lockHook;
+    forkUnlockHook = unlockHook;
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+};  // namespace native
+
+static inline uint64_t sim_get_tid() {
+    uint32_t tid = native::curTid;
+    if (__builtin_expect(tid == native::kInvalidTid, 0)) tid = native::acquireTid();
+    return tid;
+}
@@ -0,0 +1,221 @@
+/** $lic$
+ * Copyright (C) 2017-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of plsalloc.
+ *
+ * plsalloc is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * plsalloc was developed as part of the Swarm architecture project. If you use
+ * this software in your research, we request that you reference the Swarm
+ * MICRO 2018 paper ("Harmonizing Speculative and Non-Speculative Execution in
+ * Architectures for Ordered Parallelism", Jeffrey et al., MICRO-51, 2018) as
+ * the source of plsalloc in any publications that use this software, and that
+ * you send us a citation of your work.
+ *
+ * plsalloc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Per-CPU slabs: a small array of free objects per CPU and class. Threads push
+ * and pop them in rseq critical sections, which the kernel restarts if the
+ * thread is preempted, migrates, or takes a signal before the single store
+ * that commits the operation. So these take no locks or atomic instructions,
+ * and any number of threads can share a CPU's slab.
+ *
+ * Each CPU's slab holds the length of each class's array, followed by the
+ * arrays. Requires x86-64 and glibc's rseq registration. Without them (or in
+ * threads whose registration failed), pushes and pops fail, and callers fall
+ * back to slower paths.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "common.h"
+
+#if defined(NATIVE_HAVE_RSEQ) && defined(__x86_64__)
+#define PER_CPU_SLAB_RSEQ 1
+#else
+#define PER_CPU_SLAB_RSEQ 0
+#endif
+
+namespace plsalloc {
+
+template <size_t NC> class PerCpuSlabs {
+    public:
+        // Most objects in each class's array
+        static constexpr uint32_t kSlots = 64;
+        // CPU ids this high or higher have no slab
+        static constexpr uint32_t kMaxCpus = 4096;
+
+    private:
+        static constexpr uint32_t kCpuBits = 18;  // bytes per CPU's slab
+        static constexpr size_t kArraysOffset =
+                ((NC * sizeof(uint32_t) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES) * CACHE_LINE_BYTES;
+        static_assert(kArraysOffset + NC * kSlots * sizeof(void*) <= (1ul << kCpuBits),
+                      "all arrays must fit in a CPU's slab");
+
+        char* slabs;
+        bool enabled;
+        uint32_t capacities[NC];
+
+        static inline size_t arrayOffset(size_t cl) {
+            return kArraysOffset + cl * kSlots * sizeof(void*);
+        }
+
+#if PER_CPU_SLAB_RSEQ
+        static inline char* rseqArea() {
+            return (char*) __builtin_thread_pointer() + __rseq_offset;
+        }
+#endif
+
+    public:
+        static constexpr size_t kSize = (size_t) kMaxCpus << kCpuBits;
+
+        // Maps the slabs at base (kSize bytes, only touched as used). All
+        // capacities start at 0.
+        bool init(char* base) {
+            void* mem = mmap(base, kSize, (PROT_READ|PROT_WRITE),
+                             (MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE), -1, 0);
+            if (mem == MAP_FAILED) return false;
+            slabs = base;
+#if PER_CPU_SLAB_RSEQ
+            enabled = __rseq_size != 0;
+#else
+            enabled = false;
+#endif
+            for (size_t cl = 0; cl < NC; cl++) capacities[cl] = 0;
+            return true;
+        }
+
+        // Without rseq, capacities stay 0, so pushes always fail
+        void setCapacity(size_t cl, uint32_t capacity) {
+            if (enabled) capacities[cl] = (capacity < kSlots) ? capacity : kSlots;
+        }
+
+        inline uint32_t capacity(size_t cl) const { return capacities[cl]; }
+
+        // Returns the last object of the current CPU's array of class cl, or
+        // nullptr if it's empty or there's no usable slab
+        inline void* pop(size_t cl) {
+#if PER_CPU_SLAB_RSEQ
+            void* res;
+            asm volatile(
+                // Critical section descriptor: start, length, and abort handler
+                ".pushsection __rseq_cs, \"aw\"\n\t"
+                ".balign 32\n\t"
+                "3:\n\t"
+                ".long 0, 0\n\t"
+                ".quad 1f, 2f - 1f, 4f\n\t"
+                ".popsection\n\t"
+                "5:\n\t"
+                "leaq 3b(%%rip), %%rax\n\t"
+                "movq %%rax, %c[csOff](%[rs])\n\t"
+                "1:\n\t"
+                // Unregistered threads have negative cpu ids, which fail too
+                "movl %c[cpuOff](%[rs]), %%eax\n\t"
+                "cmpl %[maxCpus], %%eax\n\t"
+                "jae 6f\n\t"
+                "shlq %[cpuBits], %%rax\n\t"
+                "addq %[slabs], %%rax\n\t"
+                "movl (%%rax, %[lenOff]), %%ecx\n\t"
+                "testl %%ecx, %%ecx\n\t"
+                "jz 6f\n\t"
+                "leaq (%%rax, %[arrOff]), %%rdx\n\t"
+                "movq -8(%%rdx, %%rcx, 8), %[res]\n\t"
+                "decl %%ecx\n\t"
+                "movl %%ecx, (%%rax, %[lenOff])\n\t"  // commit
+                "2:\n\t"
+                "jmp 7f\n\t"
+                "6:\n\t"
+                "xorl %k[res], %k[res]\n\t"
+                "7:\n\t"
+                // Abort handler, which must follow the registered signature.
+                // Restarts the whole operation.
+                ".pushsection __rseq_failure, \"ax\"\n\t"
+                ".byte 0x0f, 0xb9, 0x3d\n\t"
+                ".long %c[sig]\n\t"
+                "4:\n\t"
+                "jmp 5b\n\t"
+                ".popsection\n\t"
+                : [res] "=&r" (res)
+                : [rs] "r" (rseqArea()), [slabs] "r" (slabs),
+                  [lenOff] "r" (cl * sizeof(uint32_t)), [arrOff] "r" (arrayOffset(cl)),
+                  [maxCpus] "i" (kMaxCpus), [cpuBits] "i" (kCpuBits),
+                  [csOff] "i" (offsetof(struct rseq, rseq_cs)),
+                  [cpuOff] "i" (offsetof(struct rseq, cpu_id)), [sig] "i" (RSEQ_SIG)
+                : "rax", "rcx", "rdx", "cc", "memory");
+            return res;
+#else
+            (void) cl;
+            return nullptr;
+#endif
+        }
+
+        // Appends p to the current CPU's array of class cl. Returns false if
+        // it's full or there's no usable slab.
+        inline bool push(size_t cl, void* p) {
+#if PER_CPU_SLAB_RSEQ
+            uint32_t pushed;
+            asm volatile(
+                ".pushsection __rseq_cs, \"aw\"\n\t"
+                ".balign 32\n\t"
+                "3:\n\t"
+                ".long 0, 0\n\t"
+                ".quad 1f, 2f - 1f, 4f\n\t"
+                ".popsection\n\t"
+                "5:\n\t"
+                "leaq 3b(%%rip), %%rax\n\t"
+                "movq %%rax, %c[csOff](%[rs])\n\t"
+                "1:\n\t"
+                "movl %c[cpuOff](%[rs]), %%eax\n\t"
+                "cmpl %[maxCpus], %%eax\n\t"
+                "jae 6f\n\t"
+                "shlq %[cpuBits], %%rax\n\t"
+                "addq %[slabs], %%rax\n\t"
+                "movl (%%rax, %[lenOff]), %%ecx\n\t"
+                "cmpl %[cap], %%ecx\n\t"
+                "jae 6f\n\t"
+                "leaq (%%rax, %[arrOff]), %%rdx\n\t"
+                "movq %[p], (%%rdx, %%rcx, 8)\n\t"
+                "incl %%ecx\n\t"
+                "movl %%ecx, (%%rax, %[lenOff])\n\t"  // commit
+                "2:\n\t"
+                "movl $1, %[pushed]\n\t"
+                "jmp 7f\n\t"
+                "6:\n\t"
+                "xorl %[pushed], %[pushed]\n\t"
+                "7:\n\t"
+                ".pushsection __rseq_failure, \"ax\"\n\t"
+                ".byte 0x0f, 0xb9, 0x3d\n\t"
+                ".long %c[sig]\n\t"
+                "4:\n\t"
+                "jmp 5b\n\t"
+                ".popsection\n\t"
+                : [pushed] "=&r" (pushed)
+                : [rs] "r" (rseqArea()), [slabs] "r" (slabs), [p] "r" (p),
+                  [cap] "r" (capacities[cl]),
+                  [lenOff] "r" (cl * sizeof(uint32_t)), [arrOff] "r" (arrayOffset(cl)),
+                  [maxCpus] "i" (kMaxCpus), [cpuBits] "i" (kCpuBits),
+                  [csOff] "i" (offsetof(struct rseq, rseq_cs)),
+                  [cpuOff] "i" (offsetof(struct rseq, cpu_id)), [sig] "i" (RSEQ_SIG)
+                : "rax", "rcx", "rdx", "cc", "memory");
+            return pushed;
+#else
+            (void) cl;
+            (void) p;
+            return false;
+#endif
+        }
+};
+
+};  // namespace plsalloc
@@ -29,9 +29,10 @@
 #include <string.h>
 #include <errno.h>
 #include <malloc.h>
+#include <new>
 //#include <sys/mman.h>
 #include <tuple>
-#include "swarm/hooks.h"
+#include "common.h"
 
 /* Layout (NOTE: Keep in sync with simulator tracked/untracked segments) */
 // 512 GB tracked + 512GB untracked (leave first 512GB of each segment to sim)
@@ -42,6 +43,14 @@
 
 /* Helper methods for abort / commit handlers (all of which call dealloc) */
 
+#ifdef PLSALLOC_NATIVE
+// Native runs never abort, and all frees are irrevocable, so on-abort deallocs
+// are dropped and on-commit deallocs happen right away.
+template <bool onAbort>
+static void enqueue_dealloc(void* ptr) {
+    if (!onAbort) plsalloc::do_dealloc(ptr);
+}
+#else
 static void dealloc_task(uint64_t ts, void* p) { plsalloc::do_dealloc(p); }
 
 template <bool onAbort>
@@ -56,8 +65,10 @@ static void enqueue_dealloc(void* ptr) {
     uint64_t magicOp = (MAGIC_OP_TASK_ENQUEUE_BEGIN + numArgs) | hintFlags;
     sim_magic_op_2(magicOp, reinterpret_cast<uint64_t>(ptr), reinterpret_cast<uint64_t>(&dealloc_task));
 }
+#endif
 
 static void on_abort_dealloc(void* ptr) {
+    if (unlikely(!ptr)) return;  // failed allocs have nothing to free
     if (sim_priv_isdoomed()) plsalloc::do_dealloc(ptr);
     else enqueue_dealloc<true>(ptr);
 }
@@ -67,6 +78,12 @@ static void on_commit_dealloc(void* ptr) {
     else enqueue_dealloc<false>(ptr);
 }
 
+// align is 0 for unaligned allocs. Deferred frees look up the chunk's class.
+static void on_commit_sized_dealloc(void* ptr, size_t size, size_t align) {
+    if (sim_isirrevocable()) plsalloc::do_sized_dealloc(ptr, size, align);
+    else enqueue_dealloc<false>(ptr);
+}
+
 /* External malloc interface */
 
 void* malloc(size_t size) {
@@ -75,17 +92,39 @@ void* malloc(size_t size) {
     void* p = plsalloc::do_alloc(size);
     on_abort_dealloc(p);
     sim_priv_ret();
+    if (unlikely(!p)) errno = ENOMEM;
     return p;
 }
 
 void* calloc(size_t nmemb, size_t size) {
-    size_t sz = nmemb * size;
+    size_t sz;
+    if (unlikely(__builtin_mul_overflow(nmemb, size, &sz))) {
+        errno = ENOMEM;
+        return nullptr;
+    }
     if (unlikely(!sz)) return nullptr;
     sim_priv_call();
     void* p = plsalloc::do_alloc(sz);
     on_abort_dealloc(p);
     sim_priv_ret();
-    memset(p, 0, sz);
+    if (unlikely(!p)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    // Clear all but the pages known to be zero (e.g., fresh or released
+    // memory), so those aren't even touched
+    char* dirty = (char*) p;
+    char* end = dirty + sz;
+    while (dirty < end) {
+        char* zero;
+        char* zeroEnd;
+        sim_priv_call();
+        std::tie(zero, zeroEnd) = plsalloc::known_zero_pages(dirty, end);
+        sim_priv_ret();
+        memset(dirty, 0, zero - dirty);
+        dirty = zeroEnd;
+    }
     return p;
 }
 
@@ -101,12 +140,39 @@ void* realloc(void* ptr, size_t size) {
         }
 
         size_t chunkSize = plsalloc::chunk_size(ptr);
-        // If it fits and we're not wasting too much space, do nothing
-        if (chunkSize >= size && chunkSize/2 <= size) return ptr;
+        // If it fits and we're not wasting too much space, do nothing. The
+        // chunk must also keep the class size maps to, for sized frees.
+        if (chunkSize >= size && chunkSize/2 <= size &&
+                plsalloc::sized_class_matches(ptr, size)) {
+            sim_priv_ret();
+            return ptr;
+        }
+
+        // Large chunks may grow or shrink in place. Shrinking frees the tail,
+        // so it's only safe if this task can't abort.
+        if (plsalloc::do_resize(ptr, size, sim_isirrevocable())) {
+            sim_priv_ret();
+            return ptr;
+        }
+
+#ifdef PLSALLOC_NATIVE
+        // Huge chunks move their pages instead of copying them
+        void* movedPtr = plsalloc::do_remap(ptr, size);
+        if (movedPtr) {
+            sim_priv_ret();
+            on_commit_dealloc(ptr);
+            return movedPtr;
+        }
+#endif
 
         void* newPtr = plsalloc::do_alloc(size);
         on_abort_dealloc(newPtr);
         sim_priv_ret();
+        if (unlikely(!newPtr)) {
+            // ptr stays valid
+            errno = ENOMEM;
+            return nullptr;
+        }
         memcpy(newPtr, ptr, (size < chunkSize) ? size : chunkSize);
         on_commit_dealloc(ptr);
         return newPtr;
@@ -125,33 +191,153 @@ void free(void* ptr) {
 
 void cfree(void* ptr) { free(ptr); }
 
+// C23 sized frees. size (and alignment) must be those the chunk was allocated
+// with, which spares the sizemap lookup.
+extern "C" void free_sized(void* ptr, size_t size) {
+    if (!ptr) return;
+    on_commit_sized_dealloc(ptr, size, 0);
+}
+
+extern "C" void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+    if (!ptr) return;
+    on_commit_sized_dealloc(ptr, size, alignment);
+}
+
+// alignment must be a power of 2
+static void* aligned_malloc(size_t alignment, size_t size) {
+    if (unlikely(!size)) return nullptr;
+    sim_priv_call();
+    void* p = plsalloc::do_aligned_alloc(size, alignment);
+    on_abort_dealloc(p);
+    sim_priv_ret();
+    if (unlikely(!p)) errno = ENOMEM;
+    return p;
+}
+
+static inline bool is_pow2(size_t x) { return x && !(x & (x - 1)); }
+
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
     // NOTE: On failure, posix_memalign doesn't modify memptr
-    if (size == 0) {
-        *memptr = nullptr;
-    } else if (!alignment || (alignment & (alignment - 1))
-               || (alignment % sizeof(void*))) {
-        return EINVAL;
-    } else {
-        // FIXME(dsm): Cache-line aligned for now
-        void* ptr = malloc(size);
-        if (!ptr) return ENOMEM;
-        *memptr = ptr;
-    }
+    if (!is_pow2(alignment) || (alignment % sizeof(void*))) return EINVAL;
+    void* ptr = aligned_malloc(alignment, size);
+    if (!ptr && size) return ENOMEM;
+    *memptr = ptr;
     return 0;
 }
 
 void* aligned_alloc(size_t alignment, size_t size) {
-    void* ptr;
-    int dc = posix_memalign(&ptr, alignment, size);
-    if (dc != 0) ptr = nullptr;
-    return ptr;
+    if (!is_pow2(alignment)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return aligned_malloc(alignment, size);
 }
 
 void* memalign(size_t alignment, size_t size) {
-    return aligned_alloc(alignment, size);
+    // Like glibc, round alignment up to a power of 2
+    if (!is_pow2(alignment)) {
+        if (alignment > (SIZE_MAX >> 1) + 1) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        alignment = alignment ? (1ul << (64 - __builtin_clzl(alignment))) : 1;
+    }
+    return aligned_malloc(alignment, size);
 }
 
+void* valloc(size_t size) {
+    return aligned_malloc(plsalloc::kOsPageSize, size);
+}
+
+void* pvalloc(size_t size) {
+    // Like glibc, round up to whole pages, and return one page for size 0
+    size_t pageSize = plsalloc::kOsPageSize;
+    if (unlikely(size > SIZE_MAX - pageSize + 1)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    size_t sz = size ? (size + pageSize - 1) & ~(pageSize - 1) : pageSize;
+    return aligned_malloc(pageSize, sz);
+}
+
+/* C++ allocation interface. Implemented directly on the internal interface,
+ * rather than through libstdc++'s defaults, which call malloc and free.
+ */
+
+// Allocs like malloc, or aligned_malloc if align != 0, but never returns null:
+// on failure, calls the new_handler and retries, or throws bad_alloc if there
+// is none.
+static void* cpp_alloc(size_t size, size_t align) {
+    if (unlikely(!size)) size = 1;  // new must return distinct pointers
+    while (true) {
+        sim_priv_call();
+        void* p = align ? plsalloc::do_aligned_alloc(size, align) : plsalloc::do_alloc(size);
+        on_abort_dealloc(p);
+        sim_priv_ret();
+        if (likely(p != nullptr)) return p;
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+static void* cpp_alloc_nothrow(size_t size, size_t align) noexcept {
+    try {
+        return cpp_alloc(size, align);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+static void cpp_dealloc(void* ptr) noexcept {
+    if (ptr) on_commit_dealloc(ptr);
+}
+
+// new never allocs 0 bytes (see cpp_alloc), so neither do sized deletes
+static void cpp_sized_dealloc(void* ptr, size_t size, size_t align) noexcept {
+    if (ptr) on_commit_sized_dealloc(ptr, size, align);
+}
+
+void* operator new(size_t size) { return cpp_alloc(size, 0); }
+void* operator new[](size_t size) { return cpp_alloc(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return cpp_alloc_nothrow(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return cpp_alloc_nothrow(size, 0); }
+
+void operator delete(void* ptr) noexcept { cpp_dealloc(ptr); }
+void operator delete[](void* ptr) noexcept { cpp_dealloc(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { cpp_dealloc(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { cpp_dealloc(ptr); }
+void operator delete(void* ptr, size_t size) noexcept { cpp_sized_dealloc(ptr, size, 0); }
+void operator delete[](void* ptr, size_t size) noexcept { cpp_sized_dealloc(ptr, size, 0); }
+
+// Aligned variants only exist with C++17 (or -faligned-new)
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, std::align_val_t align) {
+    return cpp_alloc(size, (size_t) align);
+}
+void* operator new[](size_t size, std::align_val_t align) {
+    return cpp_alloc(size, (size_t) align);
+}
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return cpp_alloc_nothrow(size, (size_t) align);
+}
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return cpp_alloc_nothrow(size, (size_t) align);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept { cpp_dealloc(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { cpp_dealloc(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { cpp_dealloc(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { cpp_dealloc(ptr); }
+void operator delete(void* ptr, size_t size, std::align_val_t align) noexcept {
+    cpp_sized_dealloc(ptr, size, (size_t) align);
+}
+void operator delete[](void* ptr, size_t size, std::align_val_t align) noexcept {
+    cpp_sized_dealloc(ptr, size, (size_t) align);
+}
+#endif
+
 // The version of <string.h> header we have installed declares
 // the argument of strdup to be non-null. Perhaps we should
 // follow the standard and assert/assume src is non-null?
@@ -163,9 +349,9 @@ void* memalign(size_t alignment, size_t size) {
 #endif
 char* strdup(const char* src) {
     if (src == nullptr) return nullptr;
-    size_t len = strlen(src);
+    size_t len = strlen(src) + 1;  // include terminator
     char* dst = (char*)malloc(len);
-    memcpy(dst, src, len);
+    if (dst) memcpy(dst, src, len);
     return dst;
 }
 #pragma GCC diagnostic pop
@@ -185,6 +371,15 @@ size_t malloc_usable_size(void* ptr) {
     }
 }
 
+// Returns 1 if memory was returned to the OS, 0 otherwise. pad is ignored:
+// only free memory is released, and it's never returned to the system break.
+int malloc_trim(size_t pad) {
+    sim_priv_call();
+    size_t released = plsalloc::do_trim();
+    sim_priv_ret();
+    return released ? 1 : 0;
+}
+
 /* Unimplemented functions below. Programs rarely use these, so rather than
  * implementing the library in full, we do these on demand */
 
@@ -195,16 +390,6 @@ static void abort_unimplemented(const char* fn) {
     std::abort();
 }
 
-void* valloc(size_t size) {
-    abort_unimplemented(__FUNCTION__);
-    return nullptr;
-}
-
-void* pvalloc(size_t size) {
-    abort_unimplemented(__FUNCTION__);
-    return nullptr;
-}
-
 void* malloc_get_state(void) {
     abort_unimplemented(__FUNCTION__);
     return nullptr;
@@ -224,10 +409,6 @@ void malloc_stats(void) {
     abort_unimplemented(__FUNCTION__);
 }
 
-int malloc_trim(size_t) {
-    abort_unimplemented(__FUNCTION__);
-    return -1;
-}
 
 // http://www.gnu.org/software/libc/manual/html_node/Hooks-for-Malloc.html
 // __malloc_hook
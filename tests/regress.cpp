@@ -0,0 +1,638 @@
+/** $lic$
+ * Copyright (C) 2017-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of plsalloc.
+ *
+ * plsalloc is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * plsalloc was developed as part of the Swarm architecture project. If you use
+ * this software in your research, we request that you reference the Swarm
+ * MICRO 2018 paper ("Harmonizing Speculative and Non-Speculative Execution in
+ * Architectures for Ordered Parallelism", Jeffrey et al., MICRO-51, 2018) as
+ * the source of plsalloc in any publications that use this software, and that
+ * you send us a citation of your work.
+ *
+ * plsalloc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Regression tests for native builds of plsalloc (see plsalloc_tests in the
+ * SConscript). Runs every test, or those named on the command line; any
+ * failure prints the failed check and aborts.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <signal.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// C23 sized frees, which plsalloc implements (libc may not declare them)
+extern "C" void free_sized(void* ptr, size_t size);
+extern "C" void free_aligned_sized(void* ptr, size_t alignment, size_t size);
+
+// Builds with assertions check that sized frees match the chunk's class. The
+// tests are built with the allocator's flags.
+#ifdef NASSERT
+static constexpr bool kChecksSizedFrees = false;
+#else
+static constexpr bool kChecksSizedFrees = true;
+#endif
+
+#define CHECK(cond) \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        std::abort(); \
+    }
+
+static inline uint64_t pattern(size_t i, uint64_t seed) {
+    return (i + 1) * 0x9e3779b97f4a7c15ul + seed;
+}
+
+// Fill or verify words [start, end) of p
+static void fill(uint64_t* p, size_t start, size_t end, uint64_t seed) {
+    for (size_t i = start; i < end; i++) p[i] = pattern(i, seed);
+}
+
+static void verify(const uint64_t* p, size_t start, size_t end, uint64_t seed) {
+    for (size_t i = start; i < end; i++) CHECK(p[i] == pattern(i, seed));
+}
+
+// Runs fn() in a child process, and returns its wait status. Quiet children
+// discard their output.
+static int runInChild(void (*fn)(), bool quiet) {
+    fflush(nullptr);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        if (quiet) {
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+        }
+        fn();
+        fflush(nullptr);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    return status;
+}
+
+static bool aborts(void (*fn)()) {
+    int status = runInChild(fn, true);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+static bool succeeds(void (*fn)()) {
+    int status = runInChild(fn, false);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Returns a field of /proc/self/status given in kB (e.g., "VmRSS"), in bytes
+static size_t statusSize(const char* field) {
+    FILE* f = fopen("/proc/self/status", "r");
+    CHECK(f);
+    char line[256];
+    size_t fieldLen = strlen(field);
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, field, fieldLen) && line[fieldLen] == ':') {
+            kb = strtoul(line + fieldLen + 1, nullptr, 10);
+            break;
+        }
+    }
+    fclose(f);
+    CHECK(kb);
+    return kb << 10;
+}
+
+static size_t dataSize() { return statusSize("VmData"); }
+static size_t rssSize() { return statusSize("VmRSS"); }
+
+// A mix of small-object sizes, cycled through by index
+static size_t mixedSize(size_t i) {
+    const size_t sizes[] = {64, 200, 1152, 2048, 20000};
+    return sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+// Allocs n objects of mixed sizes into objs, touching them
+static void allocMixed(void** objs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        objs[i] = malloc(mixedSize(i));
+        CHECK(objs[i]);
+        memset(objs[i], 1, mixedSize(i));
+    }
+}
+
+// Frees objs[i] for i in [start, end) with stride step
+static void freeObjs(void** objs, size_t start, size_t end, size_t step) {
+    for (size_t i = start; i < end; i += step) free(objs[i]);
+}
+
+/* Tests */
+
+// Huge chunks move their pages on realloc. Meanwhile, another thread maps and
+// unmaps memory, which must never land in (and be clobbered by) a moved range.
+static void testHugeRealloc() {
+    std::atomic<bool> done(false);
+    std::thread mapper([&done]() {
+        const size_t sz = 2ul << 20;
+        const size_t stride = 4096 / sizeof(uint64_t);
+        for (uint64_t seed = 0; !done.load(); seed++) {
+            uint64_t* m = (uint64_t*) mmap(nullptr, sz, PROT_READ|PROT_WRITE,
+                                           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            CHECK(m != MAP_FAILED);
+            for (size_t i = 0; i < sz / 8; i += stride) m[i] = pattern(i, seed);
+            std::this_thread::yield();
+            for (size_t i = 0; i < sz / 8; i += stride) CHECK(m[i] == pattern(i, seed));
+            munmap(m, sz);
+        }
+    });
+
+    for (uint64_t seed = 0; seed < 4; seed++) {
+        size_t words = (8ul << 20) / 8;
+        uint64_t* p = (uint64_t*) malloc(words * 8);
+        CHECK(p);
+        fill(p, 0, words, seed);
+        for (int r = 0; r < 6; r++) {
+            // Sizes that aren't whole huge pages, so tails are copied
+            size_t newWords = words * 3 / 2 + 520;
+            p = (uint64_t*) realloc(p, newWords * 8);
+            CHECK(p);
+            verify(p, 0, words, seed);
+            fill(p, words, newWords, seed);
+            words = newWords;
+        }
+        for (int r = 0; r < 4; r++) {
+            words = words / 2 + 24;
+            p = (uint64_t*) realloc(p, words * 8);
+            CHECK(p);
+            verify(p, 0, words, seed);
+        }
+        free(p);
+    }
+
+    done.store(true);
+    mapper.join();
+}
+
+// Sized frees of any size in the chunk's class (or of large chunks) work, and
+// debug builds catch sizes of another class
+static void testSizedFree() {
+    const size_t sizes[] = {1, 8, 24, 64, 100, 512, 1000, 4096, 5000, 40000,
+                            100000, 250000, 300000, 1ul << 20, 20ul << 20};
+    for (int r = 0; r < 3; r++) {
+        for (size_t size : sizes) {
+            char* p = (char*) malloc(size);
+            CHECK(p);
+            memset(p, r, size);
+            free_sized(p, size);
+
+            p = new char[size];
+            memset(p, r, size);
+            ::operator delete[](p, size);
+        }
+    }
+
+    for (size_t align = 64; align <= (64ul << 10); align *= 4) {
+        for (size_t size : sizes) {
+            size_t sz = (size + align - 1) & ~(align - 1);
+            void* p = aligned_alloc(align, sz);
+            CHECK(p && !((uintptr_t) p & (align - 1)));
+            memset(p, 1, sz);
+            free_aligned_sized(p, align, sz);
+        }
+    }
+
+    if (kChecksSizedFrees) {
+        CHECK(aborts([]() {
+            void* p = malloc(100);
+            free_sized(p, 5000);
+        }));
+        CHECK(aborts([]() {
+            void* p = malloc(1ul << 20);
+            free_sized(p, 64);
+        }));
+        CHECK(aborts([]() {
+            void* p = malloc(1ul << 20);
+            free_sized(p, 2ul << 20);
+        }));
+    }
+
+    // realloc keeps chunks only for sizes that sized frees accept
+    for (size_t size : sizes) {
+        char* p = (char*) malloc(size);
+        CHECK(p);
+        size_t newSize = size - size / 8;
+        p = (char*) realloc(p, newSize);
+        CHECK(p);
+        memset(p, 2, newSize);
+        free_sized(p, newSize);
+    }
+}
+
+// Allocs fail cleanly once memory runs out: C functions return null and set
+// ENOMEM, and new calls the new_handler, then throws bad_alloc
+static size_t bigSize;
+static int newHandlerCalls = 0;
+
+static void testOutOfMemory() {
+    // Sizes that can never fit (and would overflow if rounded up). volatile
+    // keeps the compiler from flagging them.
+    volatile size_t hugeSizes[] = {SIZE_MAX - 10, SIZE_MAX / 2};
+    for (size_t size : hugeSizes) {
+        errno = 0;
+        CHECK(!malloc(size) && errno == ENOMEM);
+    }
+    void* p = nullptr;
+    CHECK(posix_memalign(&p, 1ul << 62, 64) == ENOMEM && !p);
+
+    // Run out of memory for real, by keeping the data segment from growing.
+    // (Committing tracked memory replaces part of its reservation, which the
+    // kernel doesn't count against the limit, so leave no room at all.)
+    // Earlier tests may have left free memory in it, so bigSize doesn't fit.
+    CHECK(succeeds([]() {
+        size_t data = dataSize();
+        struct rlimit lim;
+        lim.rlim_cur = lim.rlim_max = data - 4096;
+        CHECK(setrlimit(RLIMIT_DATA, &lim) == 0);
+        bigSize = data + (64ul << 20);
+
+        errno = 0;
+        CHECK(!malloc(bigSize) && errno == ENOMEM);
+        errno = 0;
+        CHECK(!calloc(bigSize / 8, 8) && errno == ENOMEM);
+
+        // Failed reallocs keep the old chunk
+        char* s = (char*) malloc(1000);
+        CHECK(s);
+        memset(s, 7, 1000);
+        errno = 0;
+        CHECK(!realloc(s, bigSize) && errno == ENOMEM);
+        for (size_t i = 0; i < 1000; i++) CHECK(s[i] == 7);
+        free(s);
+
+        bool threw = false;
+        try {
+            char* c = new char[bigSize];
+            c[0] = 0;
+        } catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(!new (std::nothrow) char[bigSize]);
+
+        // The handler may free memory and retry; this one gives up after two
+        std::set_new_handler([]() {
+            if (++newHandlerCalls == 2) std::set_new_handler(nullptr);
+        });
+        threw = false;
+        try {
+            char* c = new char[bigSize];
+            c[0] = 0;
+        } catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        CHECK(threw && newHandlerCalls == 2);
+
+        // Exhaust memory with small and large chunks (linked through their
+        // first word), then check that freeing them makes it usable again
+        const size_t sizes[] = {64, 100000, 1ul << 20};
+        for (size_t size : sizes) {
+            void* chunks = nullptr;
+            errno = 0;
+            while (void* c = malloc(size)) {
+                *(void**) c = chunks;
+                chunks = c;
+            }
+            CHECK(chunks && errno == ENOMEM);
+            while (chunks) {
+                void* next = *(void**) chunks;
+                free(chunks);
+                chunks = next;
+            }
+            void* q = malloc(size);
+            CHECK(q);
+            free(q);
+        }
+    }));
+}
+
+// Objects allocated by one thread and freed by others are reused, even when
+// the allocating thread exits while they're being freed, or stays alive but
+// idle
+static void testCrossThreadFree() {
+    const size_t n = 16 * 1024;  // ~75MB per round
+    const size_t consumers = 3;
+    void** objs = (void**) malloc(n * sizeof(void*));
+    CHECK(objs);
+
+    size_t warmRss = 0;
+    for (int round = 0; round < 16; round++) {
+        std::atomic<bool> ready(false);
+        std::thread producer([&]() {
+            allocMixed(objs, n);
+            ready.store(true);
+            // Exits right away, racing with the consumers' frees
+        });
+        std::thread threads[consumers];
+        for (size_t c = 0; c < consumers; c++) {
+            threads[c] = std::thread([&, c]() {
+                while (!ready.load()) std::this_thread::yield();
+                freeObjs(objs, c, n, consumers);
+            });
+        }
+        producer.join();
+        for (std::thread& t : threads) t.join();
+        if (round == 1) warmRss = rssSize();
+    }
+    CHECK(rssSize() < warmRss + (32ul << 20));
+
+    // An idle owner must not hold on to what others free to it
+    std::atomic<bool> allocated(false);
+    std::atomic<bool> done(false);
+    std::thread owner([&]() {
+        allocMixed(objs, n);
+        allocated.store(true);
+        while (!done.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    while (!allocated.load()) std::this_thread::yield();
+    size_t startRss = rssSize();
+    for (int round = 0; round < 4; round++) {
+        freeObjs(objs, 0, n, 1);
+        allocMixed(objs, n);
+    }
+    CHECK(rssSize() < startRss + (32ul << 20));
+    freeObjs(objs, 0, n, 1);
+    done.store(true);
+    owner.join();
+    free(objs);
+}
+
+// Objects a thread frees before exiting are reused by the next thread, in
+// every class. The exiting thread's cache holds all of them, so they go back
+// in full blocks, which some classes fetch fewer objects than. (The next
+// thread may also get objects its cache had fetched but not handed out.)
+static void testThreadExitReuse() {
+    const size_t n = 100;
+    const size_t sizes[] = {64, 512, 1152, 2048};
+    uintptr_t* freed = (uintptr_t*) malloc(n * sizeof(uintptr_t));
+    CHECK(freed);
+    for (size_t size : sizes) {
+        std::thread([&]() {
+            void** objs = (void**) malloc(n * sizeof(void*));
+            CHECK(objs);
+            for (size_t i = 0; i < n; i++) {
+                objs[i] = malloc(size);
+                CHECK(objs[i]);
+                freed[i] = (uintptr_t) objs[i];
+            }
+            for (size_t i = 0; i < n; i++) free(objs[i]);
+            free(objs);
+        }).join();
+        std::sort(freed, freed + n);
+
+        size_t reused = 0;
+        std::thread([&]() {
+            void** objs = (void**) malloc(n * sizeof(void*));
+            CHECK(objs);
+            for (size_t i = 0; i < n; i++) {
+                objs[i] = malloc(size);
+                CHECK(objs[i]);
+                reused += std::binary_search(freed, freed + n, (uintptr_t) objs[i]);
+            }
+            for (size_t i = 0; i < n; i++) free(objs[i]);
+            free(objs);
+        }).join();
+        CHECK(reused >= n / 2);
+    }
+    free(freed);
+}
+
+// Objects freed by many threads land in several central freelist banks (and
+// partly in transfer caches), yet their spans are still reclaimed once fully
+// free, and malloc_trim returns them to the OS
+static void testTrimAfterSharedFrees() {
+    const size_t n = 32768;
+    const size_t size = 1000;
+    const size_t nthreads = 8;
+    malloc_trim(0);
+    size_t startRss = rssSize();
+
+    void** objs = (void**) malloc(n * sizeof(void*));
+    CHECK(objs);
+    for (size_t i = 0; i < n; i++) {
+        objs[i] = malloc(size);
+        CHECK(objs[i]);
+        memset(objs[i], 1, size);
+    }
+    CHECK(rssSize() > startRss + n * size / 2);
+
+    // All threads get their (lazily assigned) thread ids before any frees, so
+    // they have different ids and use different banks. Each frees objects from
+    // every span.
+    std::atomic<size_t> started(0);
+    std::thread threads[nthreads];
+    for (size_t t = 0; t < nthreads; t++) {
+        threads[t] = std::thread([&, t]() {
+            void* volatile p = malloc(8);
+            free(p);
+            started++;
+            while (started.load() < nthreads) std::this_thread::yield();
+            freeObjs(objs, t, n, nthreads);
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    free(objs);
+
+    CHECK(malloc_trim(0));
+    CHECK(rssSize() < startRss + n * size / 4);
+    // Nothing new to release
+    CHECK(!malloc_trim(0));
+}
+
+// Replacing random survivors of a mostly freed heap, in batches, fills the
+// fullest spans first, so the emptiest ones drain and malloc_trim returns them
+// instead of the survivors staying scattered across all the spans
+static void testChurnCompacts() {
+    const size_t n = 65536;
+    const size_t size = 1000;
+    const size_t batch = 512;  // more than thread caches hold
+    malloc_trim(0);
+    size_t startRss = rssSize();
+
+    void** objs = (void**) malloc(n * sizeof(void*));
+    CHECK(objs);
+    for (size_t i = 0; i < n; i++) {
+        objs[i] = malloc(size);
+        CHECK(objs[i]);
+        memset(objs[i], 1, size);
+    }
+    // Keep a random tenth
+    uint64_t seed = 1;
+    size_t live = 0;
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        if ((seed >> 33) % 10) free(objs[i]);
+        else objs[live++] = objs[i];
+    }
+    // Replace each survivor about 20 times
+    for (size_t round = 0; round < 20 * live / batch; round++) {
+        size_t idx[batch];
+        for (size_t& j : idx) {
+            seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+            j = (seed >> 33) % live;
+            free(objs[j]);
+            objs[j] = nullptr;
+        }
+        for (size_t j : idx) {
+            if (objs[j]) continue;
+            objs[j] = malloc(size);
+            CHECK(objs[j]);
+            memset(objs[j], 2, size);
+        }
+    }
+
+    malloc_trim(0);
+    CHECK(rssSize() < startRss + n * size / 4);
+    freeObjs(objs, 0, live, 1);
+    free(objs);
+}
+
+// A loop that allocs, fills, and frees a large chunk reuses its pages instead
+// of releasing them on every free and faulting them back in
+static void testLargeReuse() {
+    const size_t sizes[] = {3ul << 20, 4ul << 20, 16ul << 20};
+    const int rounds = 16;
+    for (size_t size : sizes) {
+        struct rusage start, end;
+        getrusage(RUSAGE_SELF, &start);
+        for (int r = 0; r < rounds; r++) {
+            char* volatile p = (char*) malloc(size);
+            CHECK(p);
+            memset(p, r, size);
+            free(p);
+        }
+        getrusage(RUSAGE_SELF, &end);
+        // At most about one round's faults
+        CHECK((size_t) (end.ru_minflt - start.ru_minflt) < 2 * size / 4096);
+    }
+}
+
+// Many threads alloc, fill, check, and free small objects at once. With
+// per-CPU caches, they share caches and are preempted mid-op, so an object
+// handed out twice (or lost and reused) shows up as a clobbered pattern.
+static void testSharedAllocs() {
+    const size_t nthreads = 16;
+    const size_t n = 64;
+    const size_t rounds = 20000;
+    std::thread threads[nthreads];
+    for (size_t t = 0; t < nthreads; t++) {
+        threads[t] = std::thread([t]() {
+            uint64_t* objs[n];
+            for (size_t r = 0; r < rounds; r++) {
+                uint64_t seed = (t << 32) | r;
+                for (size_t i = 0; i < n; i++) {
+                    size_t words = 2 * (1 + (i + r) % 8);
+                    objs[i] = (uint64_t*) malloc(words * 8);
+                    CHECK(objs[i]);
+                    fill(objs[i], 0, words, seed + i);
+                }
+                if (r % 16 == 0) std::this_thread::yield();
+                for (size_t i = 0; i < n; i++) {
+                    verify(objs[i], 0, 2 * (1 + (i + r) % 8), seed + i);
+                    free(objs[i]);
+                }
+            }
+        });
+    }
+    for (std::thread& t : threads) t.join();
+}
+
+// Forks while other threads alloc and free. The child must find no allocator
+// lock held, or it would hang on its first allocs (the alarm makes that fail).
+static void testForkWhileAllocating() {
+    const size_t nthreads = 4;
+    const size_t n = 64;
+    std::atomic<bool> done(false);
+    std::thread threads[nthreads];
+    for (size_t t = 0; t < nthreads; t++) {
+        threads[t] = std::thread([&done]() {
+            void* objs[n] = {};
+            for (size_t r = 0; !done.load(); r++) {
+                size_t i = r % n;
+                free(objs[i]);
+                // Mostly small objects, and some large ones
+                objs[i] = malloc((r % 16 == 0) ? 300000 + (r % 8) * 4096 : mixedSize(r));
+                CHECK(objs[i]);
+            }
+            for (void* p : objs) free(p);
+        });
+    }
+
+    for (int f = 0; f < 100; f++) {
+        CHECK(succeeds([]() {
+            alarm(10);
+            void* objs[n];
+            allocMixed(objs, n);
+            void* large = malloc(1ul << 20);
+            CHECK(large);
+            memset(large, 1, 1ul << 20);
+            free(large);
+            freeObjs(objs, 0, n, 1);
+            malloc_trim(0);
+        }));
+    }
+    done = true;
+    for (std::thread& t : threads) t.join();
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+static const Test tests[] = {
+    // Runs first, as free objects left by other tests would be reused first
+    {"thread_exit_reuse", testThreadExitReuse},
+    {"huge_realloc", testHugeRealloc},
+    {"sized_free", testSizedFree},
+    {"out_of_memory", testOutOfMemory},
+    {"cross_thread_free", testCrossThreadFree},
+    {"trim_after_shared_frees", testTrimAfterSharedFrees},
+    {"churn_compacts", testChurnCompacts},
+    {"large_reuse", testLargeReuse},
+    {"fork_while_allocating", testForkWhileAllocating},
+    {"shared_allocs", testSharedAllocs},
+};
+
+int main(int argc, char* argv[]) {
+    for (const Test& t : tests) {
+        bool selected = (argc == 1);
+        for (int a = 1; a < argc; a++) selected |= !strcmp(argv[a], t.name);
+        if (!selected) continue;
+        printf("%s... ", t.name);
+        fflush(stdout);
+        t.run();
+        printf("ok\n");
+    }
+    return 0;
+}